@@ -4,6 +4,7 @@
 #include "llvm/Util.h"
 #include "util/Util.h"
 
+#include <cstdio>
 #include <iostream>
 #include <string>
 
@@ -54,7 +55,7 @@ struct X : PassRegistrationListener {
 static void
 usage (const char *name)
 {
-    cerr << "" << name <<" [-v] [-n] [-s] < [in.bc] > [out.bc]" << endl;
+    cerr << "" << name <<" [-v] [-n] [-s] [-f summaries] [-c y,l,p,c] [-t size,percent] [-p|-P plan] [-r] [-C cachedir] < [in.bc] > [out.bc]" << endl;
     cerr << endl;
     cerr << "\t\t\t\t| phase var.\t| dyn. com.\t|"<< endl;
     cerr << "-------------------------------------------------------------"<< endl;
@@ -65,6 +66,15 @@ usage (const char *name)
     cerr << "Select -l to disable static locked region identification" << endl;
     cerr << "(reductions as in Transactions for Software Model Checking by Qadeer/Flanagan)." << endll;
     cerr << "Select -y to insert local yields after each statement." << endl;
+    cerr << "Select -f to load library function summaries (see llvm/Summary.h)." << endl;
+    cerr << "Select -c to weigh global yields, local yields, phase updates and checks" << endl;
+    cerr << "for the placement of cycle yields (default 4,2,1,2)." << endl;
+    cerr << "Select -t to yield statically instead of checking when the check is larger" << endl;
+    cerr << "(blocks listed by __act plus pointer and lock compares) or has a higher" << endl;
+    cerr << "estimated conflict chance (default 64,90)." << endl;
+    cerr << "Select -p to write the yield plan, -P to apply a plan instead of the analysis" << endl;
+    cerr << "of movers and blocks, and -r to only report the plan (dry run)." << endl;
+    cerr << "Select -C to cache yield plans in a directory, keyed by the code and options." << endl;
     cerr << endl;
     cerr << "Select one of -n and -s (either no dynamic commutativity or static blocks)." << endl;
     cerr << endl;
@@ -91,6 +101,25 @@ main( int argc, const char *argv[] )
             o.nodyn = true;
         } else if (strcmp(argv[i], "-l") == 0) {
             o.nolock = true;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            o.summaries = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            o.planOut = argv[++i];
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            o.planIn = argv[++i];
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            o.cacheDir = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            o.dryRun = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            if (sscanf (argv[++i], "%d,%d", &o.checkSize, &o.actPercent) != 2) {
+                usage (argv[0]);
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            if (sscanf (argv[++i], "%d,%d,%d,%d", &o.costYield, &o.costLocal,
+                        &o.costPhase, &o.costCheck) != 4) {
+                usage (argv[0]);
+            }
         } else {
             usage (argv[0]);
         }
@@ -0,0 +1,35 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Relaxed flag accesses ordered by explicit fences.
+// The fences are both movers; the seq_cst counter stays a non-mover.
+
+int data = 0;
+atomic_int ready = 0;
+atomic_int count = 0;
+
+void *producer(void *arg) {
+	data = 42;
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&ready, 1, memory_order_relaxed);
+	atomic_store(&count, 1);
+	return NULL;
+}
+
+void *consumer(void *arg) {
+	while (!atomic_load_explicit(&ready, memory_order_relaxed)) { }
+	atomic_thread_fence(memory_order_acquire);
+	assert(data == 42);
+	assert(atomic_load(&count) <= 1);
+	return NULL;
+}
+
+int main() {
+  pthread_t t1, t2;
+  pthread_create(&t1, 0, producer, 0);
+  pthread_create(&t2, 0, consumer, 0);
+  pthread_join(t1, 0);
+  pthread_join(t2, 0);
+  return 0;
+}
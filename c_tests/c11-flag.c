@@ -0,0 +1,31 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Message passing over a monotonic flag with release/acquire atomics.
+// The spinning flag load is a right mover; the flag store does not commute
+// with it and stays a non-mover.
+
+int data = 0;
+atomic_int ready = 0;
+
+void *producer(void *arg) {
+	data = 42;
+	atomic_store_explicit(&ready, 1, memory_order_release);
+	return NULL;
+}
+
+void *consumer(void *arg) {
+	while (!atomic_load_explicit(&ready, memory_order_acquire)) { }
+	assert(data == 42);
+	return NULL;
+}
+
+int main() {
+  pthread_t t1, t2;
+  pthread_create(&t1, 0, producer, 0);
+  pthread_create(&t2, 0, consumer, 0);
+  pthread_join(t1, 0);
+  pthread_join(t2, 0);
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+// Treiber stack push: the CAS retry loop is reduced to one commit yield.
+// Failed iterations only write the fresh node and re-read top.
+
+struct node {
+	int val;
+	struct node *next;
+};
+
+struct node *top = NULL;
+
+void push(int val) {
+	struct node *n = malloc(sizeof(struct node));
+	struct node *old;
+	n->val = val;
+	do {
+		old = top;
+		n->next = old;
+	} while (!__sync_bool_compare_and_swap(&top, old, n));
+}
+
+void *pusher(void *arg) {
+	push(1);
+	push(2);
+	return NULL;
+}
+
+int main() {
+  pthread_t t1, t2;
+  pthread_create(&t1, 0, pusher, 0);
+  pthread_create(&t2, 0, pusher, 0);
+  pthread_join(t1, 0);
+  pthread_join(t2, 0);
+  int n = 0;
+  for (struct node *p = top; p != NULL; p = p->next) n++;
+  assert(n == 4);
+  return 0;
+}
@@ -14,7 +14,10 @@ extern bool __nondet_bool();
 
 extern void __yield(int loc);
 extern void __yield_internal(int loc);
-extern bool __act(void *(*thread) (void *),int loc,...);
+// __act(thread_1, mask_1, thread_2, mask_2, ...): some thread_i is in a block
+// of mask_i, where mask[0] is the number of 64-bit words that follow and bit
+// b of these words marks block b.
+extern bool __act(void *(*thread) (void *),const unsigned long long *mask,...);
 extern void __atomic_begin();
 extern void __atomic_end();
 
@@ -2,7 +2,10 @@
 #include "util/BitMatrix.h"
 #include "util/Util.h"
 #include "llvm/LiptonPass.h"
+#include "llvm/PlanCache.h"
+#include "llvm/Summary.h"
 #include "llvm/Util.h"
+#include "llvm/YieldPlan.h"
 
 #include <algorithm>    // std::sort
 #include <assert.h>
@@ -12,12 +15,20 @@
 #include <string>
 
 #include <llvm/Analysis/CFG.h>
+#include <llvm/Analysis/InstructionSimplify.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/Passes.h>
+#include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/GetElementPtrTypeIterator.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instruction.h>
@@ -27,16 +38,23 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Metadata.h>
+#include <llvm/IR/Operator.h>
 #include <llvm/IR/Type.h>
+#include <llvm/IR/ValueHandle.h>
 #include <llvm/Pass.h>
 #include <llvm/PassAnalysisSupport.h>
 #include <llvm/PassRegistry.h>
 #include <llvm/PassSupport.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/Local.h>
 #include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <llvm/Transforms/Utils/PromoteMemToReg.h>
+#include <llvm/Transforms/Utils/SSAUpdater.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
 #include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/ADT/SmallVector.h>
 #include <llvm/IR/ValueMap.h>
 
@@ -81,6 +99,14 @@ static const char *PTHREAD_WLOCK    = "pthread_rwlock_wrlock";
 static const char *PTHREAD_RW_UNLOCK= "pthread_rwlock_unlock";
 static const char *PTHREAD_UNLOCK   = "pthread_mutex_unlock";
 static const char *PTHREAD_MUTEX_INIT= "pthread_mutex_init";
+static const char *PTHREAD_TRYLOCK  = "pthread_mutex_trylock";
+static const char *PTHREAD_SPIN_LOCK= "pthread_spin_lock";
+static const char *PTHREAD_SPIN_TRYLOCK= "pthread_spin_trylock";
+static const char *PTHREAD_SPIN_UNLOCK= "pthread_spin_unlock";
+static const char *PTHREAD_BARRIER_WAIT= "pthread_barrier_wait";
+static const char *SEM_INIT         = "sem_init";
+static const char *SEM_WAIT         = "sem_wait";
+static const char *SEM_POST         = "sem_post";
 static const char *PTHREAD_COND_REG = "__cond_register";
 static const char *PTHREAD_COND_WAIT= "__cond_wait";
 static const char *PTHREAD_COND_SGNL= "__cond_signal";
@@ -88,6 +114,54 @@ static const char *PTHREAD_COND_BCST= "__cond_broadcast";
 static const char *ATOMIC_BEGIN     = "atomic_begin";
 static const char *ATOMIC_END       = "atomic_end";
 
+// libstdc++ wrappers (Itanium mangling), modeled without walking their bodies
+static const char *CXX_MUTEX_LOCK   = "_ZNSt5mutex4lockEv";
+static const char *CXX_MUTEX_UNLOCK = "_ZNSt5mutex6unlockEv";
+static const char *CXX_LOCK_GUARD   = "_ZNSt10lock_guardISt5mutexE";
+static const char *CXX_UNIQUE_LOCK  = "_ZNSt11unique_lockISt5mutexE";
+static const char *CXX_THREAD_CTOR  = "_ZNSt6threadC";
+static const char *CXX_THREAD_JOIN  = "_ZNSt6thread4joinEv";
+
+enum cxx_e {
+    CxxNone     = 0,
+    CxxLock,            // std::mutex::lock
+    CxxUnlock,          // std::mutex::unlock
+    CxxGuard,           // lock_guard / unique_lock constructor (mutex is arg 1)
+    CxxUnguard,         // lock_guard / unique_lock destructor
+    CxxSpawn,           // std::thread constructor (callable is arg 1)
+    CxxJoin,            // std::thread::join
+};
+
+static cxx_e
+cxxPrimitive (Function *F)
+{
+    if (F == nullptr) return CxxNone;
+    StringRef Name = F->getName();
+    if (Name == CXX_MUTEX_LOCK)     return CxxLock;
+    if (Name == CXX_MUTEX_UNLOCK)   return CxxUnlock;
+    if (Name == CXX_THREAD_JOIN)    return CxxJoin;
+    if (Name.startswith(CXX_THREAD_CTOR)) {
+        // only the callable (template) constructor C1I.. / C2I.., not the
+        // move (C2EOS_) or copy constructor
+        StringRef Member = Name.substr(strlen(CXX_THREAD_CTOR));
+        if (Member.size() > 1 && Member[1] == 'I' && F->arg_size() >= 2) return CxxSpawn;
+        return CxxNone;
+    }
+    if (Name.startswith(CXX_LOCK_GUARD) || Name.startswith(CXX_UNIQUE_LOCK)) {
+        StringRef Member = Name.substr(Name.startswith(CXX_LOCK_GUARD) ?
+                                       strlen(CXX_LOCK_GUARD) : strlen(CXX_UNIQUE_LOCK));
+        if (Member.equals("C1ERS0_") || Member.equals("C2ERS0_")) return CxxGuard;
+        if (Member.equals("D1Ev") || Member.equals("D2Ev")) return CxxUnguard;
+    }
+    return CxxNone;
+}
+
+static bool
+isStdFunction (Function *F)
+{
+    return F->getName().startswith("_ZNSt") || F->getName().startswith("_ZSt");
+}
+
 char LiptonPass::ID = 0;
 static RegisterPass<LiptonPass> X("lipton", "Lipton reduction");
 
@@ -101,6 +175,7 @@ int                             nextBlock = 0;
 
 static const char *SINGLE_THREADED = "singleThreaded";
 static const char *DYN_YIELD_CONDITION = "DynamicYieldCondition";
+static const char *SYMMETRY = "lipton.symmetry";
 
 
 static void
@@ -148,6 +223,37 @@ name ( block_e m )
     }
 }
 
+// Liptonize annotations, one bit per metadata kind (see LLVMInstr::Notes)
+static const area_e     NOTE_AREAS[]    = { Bottom, Pre, Post, Top };
+static const mover_e    NOTE_MOVERS[]   = { RightMover, LeftMover, NoneMover };
+static const uint8_t    NOTE_SINGLE     = 1 << 7;
+
+static uint8_t
+note ( area_e m )
+{
+    for (int i = 0; i < 4; i++) if (NOTE_AREAS[i] == m) return 1 << i;
+    ASSERT (false, "Missing case: "<< m); return 0;
+}
+
+static uint8_t
+note ( mover_e m )
+{
+    for (int i = 0; i < 3; i++) if (NOTE_MOVERS[i] == m) return 1 << (4 + i);
+    ASSERT (false, "Missing case: "<< m); return 0;
+}
+
+static void
+annotate (Instruction *I, uint8_t Notes)
+{
+    for (int i = 0; i < 4; i++) {
+        if (Notes & (1 << i)) addMetaData (I, name(NOTE_AREAS[i]), "");
+    }
+    for (int i = 0; i < 3; i++) {
+        if (Notes & (1 << (4 + i))) addMetaData (I, name(NOTE_MOVERS[i]), "");
+    }
+    if (Notes & NOTE_SINGLE) addMetaData (I, SINGLE_THREADED, "");
+}
+
 static const char *
 name ( pt_e m, bool add )
 {
@@ -177,6 +283,9 @@ LiptonPass::getAnalysisUsage (AnalysisUsage &AU) const
     AU.setPreservesCFG();
     AU.addRequired<AliasAnalysis>();
     AU.addRequired<CallGraphWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfo>();
+    AU.addRequired<ScalarEvolution>();
 }
 
 block_e
@@ -205,25 +314,72 @@ LLVMThread::getInstruction (Instruction *I)
 int
 LLVMThread::NrRuns ()
 {
-    int Runs = Starts.size ();
-    for (CallInst *C : Starts) {
-        if (C == nullptr)
-            break; // MAIN
-        Function *Starter = C->getParent ()->getParent ();
-        LLASSERT (Threads->find(Starter) != Threads->end(), "Thread created? "<< Starter->getName());
-        if (Threads[0][Starter]->getInstruction(C).SCC->Loops) {
-            Runs = -1; // potentially infinite
-            errs () << "THREAD: " << F.getName () << " (Potentially infinite)" << endll << *C << endll;
-            break;
-        }
-    }
+    LLASSERT (Runs != -2, "Instances not counted: "<< F.getName());
+    return RunsExact ? Runs : -1;
+}
+
+int
+LLVMThread::MaxRuns ()
+{
+    LLASSERT (Runs != -2, "Instances not counted: "<< F.getName());
     return Runs;
 }
 
 bool
 LLVMThread::isSingleton ()
 {
-    return NrRuns() == 1;
+    return MaxRuns() == 1;
+}
+
+vector<pair<Instruction *, pair<block_e, int>>>
+LLVMThread::orderedStarts ()
+{
+    vector<pair<Instruction *, pair<block_e, int>>> Starts(BlockStarts.begin(), BlockStarts.end());
+    sort (Starts.begin(), Starts.end(),
+          [] (const pair<Instruction *, pair<block_e, int>> &A,
+              const pair<Instruction *, pair<block_e, int>> &B) {
+        return A.second.second < B.second.second;
+    });
+    return Starts;
+}
+
+/**
+ * The callee whose body walkGraph walks in place of the call, or null.
+ */
+static Function *
+walkedCallee (Instruction *I)
+{
+    CallInst *Call = dyn_cast<CallInst>(I);
+    Function *Callee = Call == nullptr ? nullptr : Call->getCalledFunction();
+    if (Callee == nullptr || Callee->isIntrinsic() || Callee->isDeclaration() ||
+            cxxPrimitive (Callee) != CxxNone) {
+        return nullptr;
+    }
+    return Callee;
+}
+
+/**
+ * F and the callees walked with it, in discovery order.
+ */
+static vector<Function *>
+reachedFunctions (Function &F)
+{
+    vector<Function *> Fs(1, &F);
+    SmallPtrSet<Function *, 8> Seen;
+    Seen.insert (&F);
+    for (unsigned i = 0; i < Fs.size(); i++) {
+        for (inst_iterator I = inst_begin(Fs[i]), E = inst_end(Fs[i]); I != E; ++I) {
+            Function *Callee = walkedCallee (&*I);
+            if (Callee != nullptr && Seen.insert (Callee).second) Fs.push_back (Callee);
+        }
+    }
+    return Fs;
+}
+
+vector<Function *>
+LLVMThread::functions ()
+{
+    return reachedFunctions (F);
 }
 
 static Instruction *
@@ -241,43 +397,161 @@ getFirstNonTerminal (Instruction *I)
     return I;
 }
 
+/**
+ * Commutativity of pairs of atomicrmw operations on the same location,
+ * indexed by AtomicRMWInst::BinOp (Xchg, Add, Sub, And, Nand, Or, Xor, Max,
+ * Min, UMax, UMin). Conditional entries are decided on the constant operands.
+ */
+enum commute_e {
+    NoCommute       = 0,
+    Commute,
+    SameOperand,    // idempotent update: commutes iff both write the same value
+    DisjointSet,    // or/xor: commute iff the masks are disjoint
+    DisjointClear,  // and/(or|xor): commute iff no bit is both cleared and set
+};
+
+#define NC NoCommute
+#define CO Commute
+static constexpr commute_e RMW_COMMUTES[11][11] = {
+//            Xchg  Add  Sub  And  Nand  Or  Xor  Max  Min  UMax UMin
+/* Xchg */  { SameOperand, NC, NC, NC, NC, NC, NC, NC, NC, NC, NC },
+/* Add  */  { NC, CO, CO, NC, NC, NC, NC, NC, NC, NC, NC },
+/* Sub  */  { NC, CO, CO, NC, NC, NC, NC, NC, NC, NC, NC },
+/* And  */  { NC, NC, NC, CO, NC, DisjointClear, DisjointClear, NC, NC, NC, NC },
+/* Nand */  { NC, NC, NC, NC, NC, NC, NC, NC, NC, NC, NC },
+/* Or   */  { NC, NC, NC, DisjointClear, NC, CO, DisjointSet, NC, NC, NC, NC },
+/* Xor  */  { NC, NC, NC, DisjointClear, NC, DisjointSet, CO, NC, NC, NC, NC },
+/* Max  */  { NC, NC, NC, NC, NC, NC, NC, CO, NC, NC, NC },
+/* Min  */  { NC, NC, NC, NC, NC, NC, NC, NC, CO, NC, NC },
+/* UMax */  { NC, NC, NC, NC, NC, NC, NC, NC, NC, CO, NC },
+/* UMin */  { NC, NC, NC, NC, NC, NC, NC, NC, NC, NC, CO },
+};
+#undef NC
+#undef CO
+
+static ConstantInt *
+rmwConstant (AtomicRMWInst *A)
+{
+    return dyn_cast<ConstantInt> (A->getValOperand());
+}
+
+/**
+ * An RMW with the identity as operand only reads (e.g. fetch_add(x, 0)).
+ */
 static bool
-isCommutingAtomic (Instruction *I, Instruction *J)
+isNoopRMW (AtomicRMWInst *A)
 {
-    AtomicRMWInst *A = dyn_cast_or_null<AtomicRMWInst>(I);
-    AtomicRMWInst *B = dyn_cast_or_null<AtomicRMWInst>(J);
-    if ((A || B) && !(A && B)) {
-        //errs () << "ATOMIC: "<< *I <<": "<< *J << endll;
-
-        AtomicRMWInst *C = A ? A : B;
-        switch (C->getOperation()) {
-        case AtomicRMWInst::BinOp::Add:
-        case AtomicRMWInst::BinOp::Sub:
-            errs () << "WARNING: ATOMIC? "<< *I <<": "<< *J << endll;
-            return true;
-        default:
-            break;
-        }
-    }
-    if (!A) return false;
-    if (!B) return false;
+    ConstantInt *C = rmwConstant (A);
+    if (C == nullptr) return false;
+    const APInt &V = C->getValue ();
     switch (A->getOperation()) {
     case AtomicRMWInst::BinOp::Add:
     case AtomicRMWInst::BinOp::Sub:
-        switch (B->getOperation()) {
-        case AtomicRMWInst::BinOp::Add:
-        case AtomicRMWInst::BinOp::Sub:
-            return true;
-        default:
-            return false;
-        }
-        break;
-    case AtomicRMWInst::BinOp::Xchg:
-    case AtomicRMWInst::BinOp::Nand:
+    case AtomicRMWInst::BinOp::Or:
+    case AtomicRMWInst::BinOp::Xor:
+    case AtomicRMWInst::BinOp::UMax:
+        return V.isMinValue ();
+    case AtomicRMWInst::BinOp::And:
+    case AtomicRMWInst::BinOp::UMin:
+        return V.isAllOnesValue ();
+    case AtomicRMWInst::BinOp::Max:
+        return V.isMinSignedValue ();
+    case AtomicRMWInst::BinOp::Min:
+        return V.isMaxSignedValue ();
+    default:
+        return false;
+    }
+}
+
+/**
+ * Two RMWs commute if their effects on memory do (see RMW_COMMUTES) and
+ * neither result is used: each returns the value it finds, which includes
+ * the effect of the other one only if that ran first. A noop RMW is a load,
+ * so it only commutes with another noop.
+ */
+static bool
+isCommutingRMW (AtomicRMWInst *A, AtomicRMWInst *B)
+{
+    if (A->getValOperand()->getType() != B->getValOperand()->getType())
+        return false;
+    if (isNoopRMW(A) || isNoopRMW(B))
+        return isNoopRMW(A) && isNoopRMW(B);
+    if (!A->use_empty() || !B->use_empty())
+        return false;
+
+    commute_e C = RMW_COMMUTES[A->getOperation()][B->getOperation()];
+    if (C == NoCommute || C == Commute)
+        return C == Commute;
+
+    ConstantInt *CA = rmwConstant (A);
+    ConstantInt *CB = rmwConstant (B);
+    if (CA == nullptr || CB == nullptr)
         return false;
+    const APInt &VA = CA->getValue ();
+    const APInt &VB = CB->getValue ();
+    switch (C) {
+    case SameOperand:
+        return VA == VB;
+    case DisjointSet:
+        return (VA & VB) == 0;
+    case DisjointClear:
+        if (A->getOperation() == AtomicRMWInst::BinOp::And)
+            return (VB & ~VA) == 0;
+        return (VA & ~VB) == 0;
     default:
-        return A->getOperation() == B->getOperation();
+        ASSERT (false, "Missing case: "<< C); return false;
+    }
+}
+
+/**
+ * True if only the success bit of the CAS is used, not the old value.
+ */
+static bool
+onlySuccessUsed (AtomicCmpXchgInst *C)
+{
+    for (User *U : C->users()) {
+        ExtractValueInst *E = dyn_cast<ExtractValueInst>(U);
+        if (E == nullptr || E->getNumIndices() != 1 || *E->idx_begin() != 1)
+            return false;
     }
+    return true;
+}
+
+/**
+ * Two CAS operations with constant operands commute if neither can enable or
+ * disable the other: the expected values differ, and neither new value equals
+ * the value the other expects. Then the success bits do not depend on the
+ * order, but the old value a failing CAS returns does (it may see the new
+ * value of the other), so it must be unused.
+ */
+static bool
+isCommutingCas (AtomicCmpXchgInst *A, AtomicCmpXchgInst *B)
+{
+    ConstantInt *EA = dyn_cast<ConstantInt> (A->getCompareOperand());
+    ConstantInt *EB = dyn_cast<ConstantInt> (B->getCompareOperand());
+    ConstantInt *NA = dyn_cast<ConstantInt> (A->getNewValOperand());
+    ConstantInt *NB = dyn_cast<ConstantInt> (B->getNewValOperand());
+    if (!EA || !EB || !NA || !NB) return false;
+    if (!onlySuccessUsed (A) || !onlySuccessUsed (B)) return false;
+    if (EA->getType() != EB->getType()) return false;
+    return EA != EB && NA != EB && NB != EA; // constants are uniqued
+}
+
+static bool
+isCommutingAtomic (Instruction *I, Instruction *J)
+{
+    AtomicCmpXchgInst *CI = dyn_cast_or_null<AtomicCmpXchgInst>(I);
+    AtomicCmpXchgInst *CJ = dyn_cast_or_null<AtomicCmpXchgInst>(J);
+    if (CI && CJ) return isCommutingCas (CI, CJ);
+
+    AtomicRMWInst *A = dyn_cast_or_null<AtomicRMWInst>(I);
+    AtomicRMWInst *B = dyn_cast_or_null<AtomicRMWInst>(J);
+    if (A && B) return isCommutingRMW (A, B);
+
+    // reads only commute with RMWs that leave memory unchanged
+    if (A && !J->mayWriteToMemory()) return isNoopRMW (A);
+    if (B && !I->mayWriteToMemory()) return isNoopRMW (B);
+    return false;
 }
 
 static AliasSet *
@@ -291,12 +565,308 @@ FindAliasSetForUnknownInst(AliasSetTracker *AST, Instruction *Inst)
     return nullptr;
 }
 
+/**
+ * The pointer arguments read or written by a summarized call with shared
+ * effects (see Summary). False if I is no such call, or if it also touches
+ * hidden global state, which only the call itself can stand for.
+ */
+bool
+LiptonPass::summaryPointers (Instruction *I, SmallVectorImpl<Value *> &Ptrs)
+{
+    CallInst *Call = dyn_cast<CallInst>(I);
+    Summary *S = Call == nullptr ? nullptr : Summaries->lookup (Call->getCalledFunction());
+    if (S == nullptr || !S->shared() || S->Global) return false;
+    for (unsigned i = 0; i < Call->getNumArgOperands() && i < 64; i++) {
+        Value *Arg = Call->getArgOperand(i);
+        if (Arg->getType()->isPointerTy() && ((S->Reads | S->Writes) >> i & 1))
+            Ptrs.push_back (Arg);
+    }
+    return true;
+}
+
+/**
+ * The alias sets of AST that I may access. A summarized call only accesses
+ * the memory of its read and written arguments, so it is not tracked as an
+ * unknown instruction, which would merge all sets it may touch.
+ */
+void
+LiptonPass::aliasSets (AliasSetTracker *AST, Instruction *I, SmallVectorImpl<AliasSet *> &Sets)
+{
+    SmallVector<Value *, 4> Ptrs;
+    if (!summaryPointers (I, Ptrs)) {
+        if (AliasSet *AS = FindAliasSetForUnknownInst (AST, I)) Sets.push_back (AS);
+        return;
+    }
+    for (AliasSet &AS : *AST) {
+        for (Value *Ptr : Ptrs) {
+            if (AS.aliasesPointer (Ptr, AliasAnalysis::UnknownSize, AAMDNodes(),
+                                   AST->getAliasAnalysis())) {
+                Sets.push_back (&AS);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * The instructions of T2 in the alias sets that I may access (see AS2I).
+ */
+vector<LLVMInstr *>
+LiptonPass::aliasing (LLVMThread *T2, Instruction *I)
+{
+    SmallVector<AliasSet *, 4> Sets;
+    aliasSets (T2->Aliases, I, Sets);
+    vector<LLVMInstr *> Is;
+    SmallPtrSet<LLVMInstr *, 16> Seen;
+    for (AliasSet *AS : Sets) {
+        for (LLVMInstr *LJ : AS2I[AS]) {
+            if (Seen.insert (LJ).second) Is.push_back (LJ);
+        }
+    }
+    return Is;
+}
+
+static Value *
+getAccessPointer (Instruction *I)
+{
+    if (LoadInst *L = dyn_cast<LoadInst>(I)) {
+        return L->getPointerOperand ();
+    } else if (StoreInst *S = dyn_cast<StoreInst>(I)) {
+        return S->getPointerOperand ();
+    } else if (AtomicRMWInst *A = dyn_cast<AtomicRMWInst>(I)) {
+        return A->getPointerOperand ();
+    } else if (AtomicCmpXchgInst *C = dyn_cast<AtomicCmpXchgInst>(I)) {
+        return C->getPointerOperand ();
+    }
+    return nullptr;
+}
+
+static bool
+isPointerCast (Value *V)
+{
+    unsigned Op = Operator::getOpcode (V);
+    return Op == Instruction::BitCast || Op == Instruction::AddrSpaceCast;
+}
+
+/**
+ * Walks the (nested) GEPs of Ptr from the base object outwards. Casts of the
+ * base object are kept (the path types record the cast type). Other casts and
+ * non-zero pointer offsets on nested GEPs may reinterpret the layout, so the
+ * path is discarded there. Non-constant indices truncate the path.
+ */
+static FieldPath *
+computeFieldPath (Value *Ptr)
+{
+    FieldPath *FP = new FieldPath ();
+    SmallVector<GEPOperator *, 4> GEPs;
+    while (true) {
+        if (GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr)) {
+            GEPs.push_back (GEP);
+            Ptr = GEP->getPointerOperand ();
+            continue;
+        }
+        if (!isPointerCast (Ptr)) break;
+        while (isPointerCast (Ptr)) {
+            Ptr = cast<Operator>(Ptr)->getOperand (0);
+        }
+        if (isa<GEPOperator>(Ptr)) { // reinterpreted field
+            FP->Base = Ptr;
+            FP->Dynamic = true;
+            return FP;
+        }
+        break; // cast of the base object
+    }
+    FP->Base = Ptr;
+
+    for (int i = GEPs.size () - 1; i >= 0; i--) { // innermost GEP first
+        GEPOperator *GEP = GEPs[i];
+        gep_type_iterator GTI = gep_type_begin (GEP);
+        for (User::op_iterator It = GEP->idx_begin (), E = GEP->idx_end ();
+                It != E; ++It, ++GTI) {
+            ConstantInt *C = dyn_cast<ConstantInt>(*It);
+            if (It == GEP->idx_begin () && i != (int) GEPs.size () - 1) {
+                if (C == nullptr || !C->isZero ()) {
+                    FP->Path.clear ();
+                    FP->Dynamic = true;
+                    return FP;
+                }
+                continue; // continues the path of the inner GEP
+            }
+            if (C == nullptr) {
+                FP->Dynamic = true;
+                return FP;
+            }
+            FP->Path.push_back (make_pair (*GTI, C->getSExtValue ()));
+        }
+    }
+    return FP;
+}
+
+bool
+FieldPath::disjoint (FieldPath &O)
+{
+    if (Base != O.Base) return false;
+    for (unsigned i = 0; i < Path.size () && i < O.Path.size (); i++) {
+        if (Path[i].first != O.Path[i].first) return false;
+        if (Path[i].second != O.Path[i].second) return true;
+    }
+    return false;
+}
+
+static bool
+disjointFields (LLVMInstr *LI, LLVMInstr *LJ)
+{
+    if (LI == nullptr || LI->Field == nullptr || LJ->Field == nullptr)
+        return false;
+    return LI->Field->disjoint (*LJ->Field);
+}
+
+static bool
+inPayloadSlot (LLVMThread *T, FieldPath *FP)
+{
+    return FP != nullptr && !T->F.arg_empty() && FP->Base == &*T->F.arg_begin() &&
+           !FP->Path.empty() && FP->Path[0].first == T->SlotType &&
+           FP->Path[0].second == 0;
+}
+
+/**
+ * Different instances of T access their own payload slot (see payloadSlots).
+ */
+static bool
+distinctInstances (LLVMThread *T, LLVMInstr *LI, LLVMInstr *LJ)
+{
+    if (T->SlotType == nullptr || LI == nullptr) return false;
+    return inPayloadSlot (T, LI->Field) && inPayloadSlot (T, LJ->Field);
+}
+
+static Value *
+lockOperand (Instruction *Lock)
+{
+    if (CallInst *Call = dyn_cast<CallInst>(Lock)) {
+        Function *Callee = Call->getCalledFunction();
+        bool second = Callee->getName().endswith(PTHREAD_COND_WAIT) ||
+                      cxxPrimitive (Callee) == CxxGuard;
+        return Call->getArgOperand(second ? 1 : 0);
+    }
+    return getAccessPointer (Lock); // spinlock
+}
+
+static const Value *
+stripIntCasts (const Value *V)
+{
+    while (isa<SExtInst>(V) || isa<ZExtInst>(V)) { // injective, unlike trunc
+        V = cast<CastInst>(V)->getOperand(0);
+    }
+    return V;
+}
+
+/**
+ * Ptr = &Base[c]..[Index]..[c]: a GEP of a constant base (global array) with
+ * a single non-constant index at operand position Pos.
+ */
+static bool
+indexedBy (const Value *Ptr, const GEPOperator *&GEP, const Value *&Index, unsigned &Pos)
+{
+    GEP = dyn_cast<GEPOperator>(Ptr->stripPointerCasts());
+    if (GEP == nullptr) return false;
+    if (!isa<Constant>(GEP->getPointerOperand()->stripPointerCasts())) return false;
+    Index = nullptr;
+    for (unsigned i = 1; i <= GEP->getNumIndices(); i++) {
+        const Value *V = GEP->getOperand(i);
+        if (isa<Constant>(V)) continue;
+        if (Index != nullptr) return false;
+        Index = stripIntCasts (V);
+        Pos = i;
+    }
+    return Index != nullptr;
+}
+
+/**
+ * Two indexed GEPs (see indexedBy) of the same family: the same base and
+ * type, and equal constant indices, so that only the symbolic index (at the
+ * same position) may differ. E.g. &locks[0][h] and &locks[1][h] are not.
+ */
+static bool
+sameFamily (const GEPOperator *A, unsigned PosA, const GEPOperator *B, unsigned PosB)
+{
+    if (PosA != PosB || A->getNumOperands() != B->getNumOperands() ||
+            A->getPointerOperandType() != B->getPointerOperandType() ||
+            A->getPointerOperand()->stripPointerCasts() != B->getPointerOperand()->stripPointerCasts()) {
+        return false;
+    }
+    for (unsigned i = 1; i < A->getNumOperands(); i++) {
+        if (i != PosA && A->getOperand(i) != B->getOperand(i)) return false; // constants are uniqued
+    }
+    return true;
+}
+
+/**
+ * Lock families (e.g. striped locks &locks[h]): on one path, two lock
+ * operands of the same family with the same symbolic index are the same
+ * lock, which AA cannot prove. Across threads (samePath false) the index of
+ * the other instance may differ, so a family member never must-aliases there.
+ */
+static AliasAnalysis::AliasResult
+lockAlias (const AliasAnalysis::Location &A, const AliasAnalysis::Location &B,
+           bool samePath)
+{
+    const GEPOperator *GA, *GB;
+    const Value *IdxA, *IdxB;
+    unsigned PosA, PosB;
+    bool IndexedA = indexedBy (A.Ptr, GA, IdxA, PosA);
+    bool IndexedB = indexedBy (B.Ptr, GB, IdxB, PosB);
+    if (samePath && IndexedA && IndexedB && IdxA == IdxB && sameFamily (GA, PosA, GB, PosB)) {
+        return AliasAnalysis::MustAlias;
+    }
+    AliasAnalysis::AliasResult Alias = AA->alias (A, B);
+    if (!samePath && (IndexedA || IndexedB) && Alias == AliasAnalysis::MustAlias) {
+        return AliasAnalysis::MayAlias;
+    }
+    return Alias;
+}
+
+/**
+ * The access of LI indexes a global array with the same symbolic index as a
+ * held lock of a lock family. Returns the family and the data array.
+ */
+static bool
+familyIndexed (LLVMInstr *LI, const GEPOperator *&LGEP, unsigned &LPos,
+               const GEPOperator *&DGEP, unsigned &DPos)
+{
+    Value *Ptr = getAccessPointer (LI->I);
+    const Value *DIdx;
+    if (Ptr == nullptr || LI->PT == nullptr || !indexedBy (Ptr, DGEP, DIdx, DPos))
+        return false;
+    for (PTCallType &Lock : LI->PT->getWriteLocks()) {
+        const Value *LIdx;
+        if (indexedBy (lockOperand (Lock.second), LGEP, LIdx, LPos) && LIdx == DIdx)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Both access the same data array under "their" lock of the same family:
+ * equal indices imply the same lock, different indices different elements.
+ */
+static bool
+familyProtected (LLVMInstr *LI, LLVMInstr *LJ)
+{
+    const GEPOperator *LGEPI, *DGEPI, *LGEPJ, *DGEPJ;
+    unsigned LPosI, DPosI, LPosJ, DPosJ;
+    if (LI == nullptr || !familyIndexed (LI, LGEPI, LPosI, DGEPI, DPosI))
+        return false;
+    if (!familyIndexed (LJ, LGEPJ, LPosJ, DGEPJ, DPosJ))
+        return false;
+    return sameFamily (LGEPI, LPosI, LGEPJ, LPosJ) && sameFamily (DGEPI, DPosI, DGEPJ, DPosJ);
+}
+
 static int
 checkAlias (list<PTCallType> &List, const AliasAnalysis::Location &Loc)
 {
     int matches = 0;
     for (PTCallType &L : List) {
-        llvm::AliasAnalysis::AliasResult Alias = AA->alias (Loc, *L.first);
+        llvm::AliasAnalysis::AliasResult Alias = lockAlias (Loc, *L.first, true);
         if (Alias == AliasAnalysis::MustAlias) {
             matches++;
         } else if (Alias != AliasAnalysis::NoAlias) {
@@ -311,7 +881,7 @@ removeAlias (list<PTCallType> &List, const AliasAnalysis::Location *Lock)
 {
     list<PTCallType>::iterator It = List.begin();
     while (It != List.end()) {
-        if (AA->alias(*Lock, *It->first) == AliasAnalysis::MustAlias) {
+        if (lockAlias (*Lock, *It->first, true) == AliasAnalysis::MustAlias) {
             List.erase(It);
             return true;
         }
@@ -325,7 +895,7 @@ removeNonAlias (list<PTCallType> &List, const AliasAnalysis::Location &Lock)
 {
     list<PTCallType>::iterator It = List.begin();
     while (It != List.end()) {
-        if (AA->alias(Lock, *It->first) != AliasAnalysis::MustAlias) {
+        if (lockAlias (Lock, *It->first, false) != AliasAnalysis::MustAlias) {
             It = List.erase(It);
         } else {
             It++;
@@ -430,7 +1000,7 @@ PThreadType::findAlias (pt_e kind, const AliasAnalysis::Location &Loc)
 }
 
 PThreadType *
-PThreadType::missed (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
+PThreadType::missed (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call)
 {
     errs () << "WARNING: missed "<< name(kind, false) <<" join/unlock: "<<*Loc.Ptr << endll << *Call << endll;
     PThreadType *PT = new PThreadType(this);
@@ -448,7 +1018,7 @@ PThreadType::missed (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Ca
 }
 
 PThreadType *
-PThreadType::eraseAlias (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
+PThreadType::eraseAlias (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call)
 {
     errs () << "END: tracking "<< name(kind, false) <<": "<< *Call << endll;
     PThreadType *PT = new PThreadType(this);
@@ -494,7 +1064,7 @@ PThreadType::eraseNonAlias (pt_e kind, PThreadType *O)
 }
 
 void
-PThreadType::eraseNonAlias (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
+PThreadType::eraseNonAlias (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call)
 {
     if (kind == ThreadStart) {
         removeNonAlias (*Threads, Loc);
@@ -506,7 +1076,7 @@ PThreadType::eraseNonAlias (pt_e kind, const AliasAnalysis::Location &Loc, CallI
 }
 
 PThreadType *
-PThreadType::add (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
+PThreadType::add (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call)
 {
     errs () << "BEGIN: tracking "<< name(kind, true) <<": "<< *Call << endll;
 
@@ -526,7 +1096,7 @@ PThreadType::add (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
 }
 
 PThreadType *
-PThreadType::overlap (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call)
+PThreadType::overlap (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call)
 {
     errs () << "WARNING: retracking (dropping) "<< name(kind, true) <<": "<<*Loc.Ptr << endll << *Call << endll;
     if (kind == ThreadStart) {
@@ -635,11 +1205,18 @@ struct LockSearch : public LiptonPass::Processor {
     }
 
     void
-    addPThread (CallInst *Call, pt_e kind, bool add)
+    addPThread (CallInst *Call, pt_e kind, bool add, unsigned Arg = 0)
     {
         if (Pass->opts.nolock && kind != ThreadStart) return;
         if (kind == ThreadStart && !PT->isCorrectThreads()) return; // nothing to do
 
+        AliasAnalysis::Location L = callLocation (Call, Arg);
+        updateLocks (Call, kind, add, L);
+    }
+
+    static AliasAnalysis::Location
+    callLocation (CallInst *Call, unsigned Arg = 0)
+    {
         AliasAnalysis::Location L;
         AliasAnalysis::ModRefResult Mask;
 //        if (kind == ThreadStart && !add) { // PTHREAD_JOIN
@@ -654,14 +1231,19 @@ struct LockSearch : public LiptonPass::Processor {
                 L = AA->getArgLocation (Call, 1, Mask);
             }
         } else {
-            if (LoadInst *Load = dyn_cast_or_null<LoadInst>(Call->getArgOperand(0))) {
+            if (LoadInst *Load = dyn_cast_or_null<LoadInst>(Call->getArgOperand(Arg))) {
                 L = AA->getLocation(Load);
             } else {
-                L = AA->getArgLocation (Call, 0, Mask);
+                L = AA->getArgLocation (Call, Arg, Mask);
             }
         }
 //        }
+        return L;
+    }
 
+    void
+    updateLocks (Instruction *Call, pt_e kind, bool add, AliasAnalysis::Location &L)
+    {
         int matches = PT->findAlias (kind, L);
         if (add) {
             if (matches == 0) {
@@ -707,6 +1289,27 @@ struct LockSearch : public LiptonPass::Processor {
         } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_JOIN)) {
             addPThread (Call, ThreadStart, false);
         } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_MUTEX_INIT)) {
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_TRYLOCK)) {
+            // lock is added on the success edge
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_TRYLOCK)) {
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_LOCK)) {
+            addPThread (Call, TotalLock, true);
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_UNLOCK)) {
+            addPThread (Call, TotalLock, false);
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_INIT)) {
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_WAIT)) {
+            if (binarySemaphore (Call)) {
+                addPThread (Call, TotalLock, true);
+            }
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_POST)) {
+            AliasAnalysis::Location L = callLocation (Call);
+            if (!Pass->opts.nolock && PT->findAlias (TotalLock, L) == 1) {
+                PT = PT->eraseAlias (TotalLock, L, Call);
+            } // else: signaling semaphore
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_BARRIER_WAIT)) {
+            ThreadF->getInstruction(Call).isBarrier = true;
+        } else if (cxx_e Cxx = cxxPrimitive (Call->getCalledFunction())) {
+            handleCxx (Call, Cxx);
         } else if (Call->getCalledFunction()->getName().endswith(ATOMIC_BEGIN)) {
             LLASSERT (!PT->isAtomic(), "Already "<< ATOMIC_BEGIN <<"encountered before: "<< Call << endll);
             PT = PT->flipAtomic ();
@@ -724,21 +1327,242 @@ struct LockSearch : public LiptonPass::Processor {
     {
         doHandle (I);
 
+        if (!Pass->opts.nolock) {
+            spinLock (I);
+        }
         return I;
     }
 
-private:
+    // Locations of the mutexes held by lock_guard / unique_lock objects
+    DenseMap<Value *, AliasAnalysis::Location> LockGuards;
+
     void
-    doHandle (Instruction *I)
+    handleCxx (CallInst *Call, cxx_e Cxx)
     {
-        LLVMInstr &LI = ThreadF->getInstruction(I);
-        LI.Atomic = PT->isAtomic();
-        if (I->mayWriteToMemory()) {
-            LI.PT = PT->resizeReadLocks (0);
-        } else {
-            LI.PT = PT;
-        }
-    }
+        switch (Cxx) {
+        case CxxLock:   addPThread (Call, TotalLock, true); break;
+        case CxxUnlock: addPThread (Call, TotalLock, false); break;
+        case CxxGuard:
+            LockGuards[Call->getArgOperand(0)] = callLocation (Call, 1);
+            addPThread (Call, TotalLock, true, 1);
+            break;
+        case CxxUnguard: {
+            if (Pass->opts.nolock) break;
+            DenseMap<Value *, AliasAnalysis::Location>::iterator It =
+                    LockGuards.find (Call->getArgOperand(0));
+            if (It == LockGuards.end()) {
+                PT = PT->missed (TotalLock, callLocation (Call), Call);
+            } else {
+                updateLocks (Call, TotalLock, false, It->second);
+            }
+            break; }
+        case CxxSpawn:
+            addPThread (Call, ThreadStart, true);
+            ThreadF->getInstruction(Call).isPTCreate = true;
+            break;
+        case CxxJoin:   addPThread (Call, ThreadStart, false); break;
+        default: ASSERT (false, "Missing case: "<< Cxx);
+        }
+    }
+
+    // Trylock: the lock is only held on the success branch (returns 0)
+    vector<PThreadType *>                   Edges;
+
+    void
+    edge (TerminatorInst *T, int i, bool enter)
+    {
+        if (!enter) {
+            PT = Edges.back ();
+            Edges.pop_back ();
+            return;
+        }
+        Edges.push_back (PT);
+        if (CallInst *Try = trylockSuccess (T, i)) {
+            addPThread (Try, TotalLock, true);
+        } else if (Instruction *Acquire = spinAcquire (T, i)) {
+            if (!Pass->opts.nolock) {
+                AliasAnalysis::Location L = isa<AtomicCmpXchgInst>(Acquire) ?
+                        AA->getLocation (cast<AtomicCmpXchgInst>(Acquire)) :
+                        AA->getLocation (cast<AtomicRMWInst>(Acquire));
+                updateLocks (Acquire, TotalLock, true, L);
+            }
+        }
+    }
+
+private:
+    static CallInst *
+    trylockSuccess (TerminatorInst *T, int i)
+    {
+        BranchInst *Br = dyn_cast<BranchInst>(T);
+        if (Br == nullptr || !Br->isConditional()) return nullptr;
+        ICmpInst *Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+        if (Cmp == nullptr || !Cmp->isEquality()) return nullptr;
+        Constant *Zero = dyn_cast<Constant>(Cmp->getOperand(1));
+        CallInst *Call = dyn_cast<CallInst>(Cmp->getOperand(0));
+        if (Zero == nullptr || !Zero->isNullValue() || Call == nullptr ||
+                Call->getCalledFunction() == nullptr) {
+            return nullptr;
+        }
+        StringRef Name = Call->getCalledFunction()->getName();
+        if (!Name.endswith(PTHREAD_TRYLOCK) && !Name.endswith(PTHREAD_SPIN_TRYLOCK))
+            return nullptr;
+        int success = Cmp->getPredicate() == CmpInst::Predicate::ICMP_EQ ? 0 : 1;
+        return i == success ? Call : nullptr;
+    }
+
+    /**
+     * A semaphore excludes like a lock iff all its sem_init calls use an
+     * initial count of one (zero signals), and every thread that posts it
+     * also waits on it (posts of others signal).
+     */
+    bool
+    binarySemaphore (CallInst *Call)
+    {
+        AliasAnalysis::Location L = callLocation (Call);
+        bool found = false;
+        vector<CallInst *> Waits, Posts;
+        for (Function &F : *Call->getParent()->getParent()->getParent()) {
+            for (inst_iterator It = inst_begin(F), E = inst_end(F); It != E; ++It) {
+                CallInst *Sem = dyn_cast<CallInst>(&*It);
+                if (Sem == nullptr || Sem->getCalledFunction() == nullptr) continue;
+                StringRef Name = Sem->getCalledFunction()->getName();
+                if (!Name.endswith(SEM_INIT) && !Name.endswith(SEM_WAIT) &&
+                        !Name.endswith(SEM_POST)) {
+                    continue;
+                }
+                if (AA->alias (L, callLocation (Sem)) == AliasAnalysis::NoAlias)
+                    continue;
+                if (Name.endswith(SEM_WAIT)) {
+                    Waits.push_back (Sem);
+                } else if (Name.endswith(SEM_POST)) {
+                    Posts.push_back (Sem);
+                } else {
+                    ConstantInt *Count = dyn_cast<ConstantInt>(Sem->getArgOperand(2));
+                    if (Count == nullptr || !Count->isOne()) return false;
+                    found = true;
+                }
+            }
+        }
+        for (pair<Function *, LLVMThread *> &X : Pass->Threads) {
+            vector<Function *> Fs = X.second->functions ();
+            SmallPtrSet<Function *, 8> Reached(Fs.begin(), Fs.end());
+            bool posts = false, waits = false;
+            for (CallInst *Post : Posts) posts |= Reached.count (Post->getParent()->getParent()) != 0;
+            for (CallInst *Wait : Waits) waits |= Reached.count (Wait->getParent()->getParent()) != 0;
+            if (posts && !waits) return false;
+        }
+        return found;
+    }
+
+    /**
+     * Lifts hand-written spinlocks into lock events: a CAS (from an unlocked
+     * constant to another constant) or a test-and-set exchange in a retry
+     * loop acquires the lock word on its success edge (see spinAcquire), a
+     * store of the unlocked constant to a held lock word releases it. Failed
+     * retries leave the lock set unchanged.
+     */
+    void
+    spinLock (Instruction *I)
+    {
+        LLVMInstr &LI = ThreadF->getInstruction(I);
+        if (acquires (I)) {
+            LI.Mover = RightMover;
+            return;
+        }
+        StoreInst *Store = dyn_cast<StoreInst>(I);
+        if (Store == nullptr) return;
+        Constant *Val = dyn_cast<Constant>(Store->getValueOperand());
+        if (!Val || !Val->isNullValue()) return;
+        AliasAnalysis::Location L = AA->getLocation (Store);
+        if (PT->findAlias (TotalLock, L) != 1) return;
+        if (!isSpinLockWord (L)) return;
+        updateLocks (I, TotalLock, false, L);
+        LI.Mover = LeftMover;
+    }
+
+    static bool
+    acquires (Instruction *I)
+    {
+        if (AtomicCmpXchgInst *Cas = dyn_cast<AtomicCmpXchgInst>(I)) {
+            Constant *Old = dyn_cast<Constant>(Cas->getCompareOperand());
+            Constant *New = dyn_cast<Constant>(Cas->getNewValOperand());
+            return Old && New && Old != New && Old->isNullValue() && inRetryLoop (I);
+        } else if (AtomicRMWInst *Tas = dyn_cast<AtomicRMWInst>(I)) {
+            Constant *New = dyn_cast<Constant>(Tas->getValOperand());
+            return Tas->getOperation() == AtomicRMWInst::BinOp::Xchg &&
+                   New && !New->isNullValue() && inRetryLoop (I);
+        }
+        return false;
+    }
+
+    /**
+     * The spinlock acquisition whose success edge is successor i of T: the
+     * CAS success bit, or a comparison of the old value with the unlocked
+     * constant (null).
+     */
+    static Instruction *
+    spinAcquire (TerminatorInst *T, int i)
+    {
+        BranchInst *Br = dyn_cast<BranchInst>(T);
+        if (Br == nullptr || !Br->isConditional()) return nullptr;
+        Value *Cond = Br->getCondition();
+        Instruction *Acquire = nullptr;
+        int success = 0;
+        if (ExtractValueInst *Ok = dyn_cast<ExtractValueInst>(Cond)) {
+            if (Ok->getNumIndices() != 1 || *Ok->idx_begin() != 1) return nullptr;
+            Acquire = dyn_cast<AtomicCmpXchgInst>(Ok->getAggregateOperand());
+        } else if (ICmpInst *Cmp = dyn_cast<ICmpInst>(Cond)) {
+            Constant *Unlocked = dyn_cast<Constant>(Cmp->getOperand(1));
+            if (!Cmp->isEquality() || Unlocked == nullptr || !Unlocked->isNullValue())
+                return nullptr;
+            Value *Old = Cmp->getOperand(0);
+            if (ExtractValueInst *V = dyn_cast<ExtractValueInst>(Old)) {
+                if (V->getNumIndices() != 1 || *V->idx_begin() != 0) return nullptr;
+                Acquire = dyn_cast<AtomicCmpXchgInst>(V->getAggregateOperand());
+            } else {
+                Acquire = dyn_cast<AtomicRMWInst>(Old);
+            }
+            success = Cmp->getPredicate() == CmpInst::Predicate::ICMP_EQ ? 0 : 1;
+        }
+        if (Acquire == nullptr || !acquires (Acquire)) return nullptr;
+        return i == success ? Acquire : nullptr;
+    }
+
+    bool
+    isSpinLockWord (AliasAnalysis::Location &L)
+    {
+        for (PTCallType &Lock : PT->getWriteLocks()) {
+            if (isa<CallInst>(Lock.second)) continue;
+            if (AA->alias (L, *Lock.first) == AliasAnalysis::MustAlias)
+                return true;
+        }
+        return false;
+    }
+
+    static bool
+    inRetryLoop (Instruction *I)
+    {
+        BasicBlock *B = I->getParent();
+        BranchInst *Br = dyn_cast<BranchInst>(B->getTerminator());
+        if (Br == nullptr || !Br->isConditional()) return false;
+        for (unsigned i = 0; i < Br->getNumSuccessors(); i++) {
+            BasicBlock *S = Br->getSuccessor(i);
+            if (S == B || isPotentiallyReachable(S, B)) return true;
+        }
+        return false;
+    }
+
+    void
+    doHandle (Instruction *I)
+    {
+        LLVMInstr &LI = ThreadF->getInstruction(I);
+        LI.Atomic = PT->isAtomic();
+        if (I->mayWriteToMemory()) {
+            LI.PT = PT->resizeReadLocks (0);
+        } else {
+            LI.PT = PT;
+        }
+    }
 };
 
 
@@ -768,6 +1592,10 @@ struct Collect : public LiptonPass::Processor {
     Instruction *
     handleCall (CallInst *Call)
     {
+        Summary *S = Pass->Summaries->lookup (Call->getCalledFunction());
+        if (S != nullptr && S->shared()) {
+            return process (Call); // collect the summarized effects
+        }
         return Call;
     }
 
@@ -830,16 +1658,27 @@ struct Collect : public LiptonPass::Processor {
         LLVMInstr &LI = ThreadF->getInstruction (I);
         if ( I->isTerminator() ||
                 dyn_cast_or_null<PHINode>(I) != nullptr ||
+                isa<FenceInst>(I) ||
                 !I->mayReadOrWriteMemory() ||
                 isa<DbgInfoIntrinsic>(I) ||
                 LI.singleThreaded ()) {
             return I;
         }
 
-        ThreadF->Aliases->add (I);
+        SmallVector<Value *, 4> Ptrs;
+        if (Pass->summaryPointers (I, Ptrs)) {
+            for (Value *Ptr : Ptrs)
+                ThreadF->Aliases->add (Ptr, AliasAnalysis::UnknownSize, AAMDNodes());
+        } else {
+            ThreadF->Aliases->add (I);
+        }
+        if (Value *Ptr = getAccessPointer (I)) {
+            LI.Field = computeFieldPath (Ptr);
+        }
 
-        AliasSet *AS = FindAliasSetForUnknownInst (ThreadF->Aliases, I);
-        Pass->AS2I[AS].push_back(&LI);
+        SmallVector<AliasSet *, 4> Sets;
+        Pass->aliasSets (ThreadF->Aliases, I, Sets);
+        for (AliasSet *AS : Sets) Pass->AS2I[AS].push_back(&LI);
         return I;
     }
 };
@@ -896,8 +1735,20 @@ struct Liptonize : public LiptonPass::Processor {
             return true;
         } else if (V.Index < 0) { // Stack
 
-            Instruction *Start = getFirstNonTerminal (B.getFirstNonPHI());
-            insertBlock (Start, LoopBlock);                 // Close cycle
+            Instruction *Head = getFirstNonTerminal (B.getFirstNonPHI());
+            if (commutingLoop (B)) {
+                if (Pass->opts.verbose) errs() << "Bounded commuting loop: "<< B << "\n";
+                ThreadF->getInstruction(Head).FVS = false;
+            } else {
+                Instruction *Start = cutPoint (B);
+                if (Start != Head) {
+                    ThreadF->getInstruction(Head).FVS = false;
+                    ThreadF->getInstruction(Start).FVS = true;
+                }
+                if (insertBlock (Start, LoopBlock) != -1) { // Close cycle
+                    ThreadF->Cuts[Start].push_back (&B);
+                }
+            }
 
             StackElem &Previous = Stack[-V.Index - 1];
             if (Previous.Area < Area) {
@@ -991,6 +1842,32 @@ struct Liptonize : public LiptonPass::Processor {
             Mover = LeftMover;
         } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_JOIN)) {
             Mover = RightMover;
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_TRYLOCK)) {
+            Mover = RightMover; // acquires on the success branch only
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_TRYLOCK)) {
+            Mover = RightMover;
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_LOCK)) {
+            Mover = RightMover;
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_SPIN_UNLOCK)) {
+            Mover = LeftMover;
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_WAIT)) {
+            Mover = RightMover;
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_POST)) {
+            Mover = LeftMover;
+        } else if (Call->getCalledFunction()->getName().endswith(SEM_INIT)) {
+            return Call;
+        } else if (Call->getCalledFunction()->getName().endswith(PTHREAD_BARRIER_WAIT)) {
+            Mover = NoneMover; // phase separator: commits, or yields in Post
+        } else if (cxx_e Cxx = cxxPrimitive (Call->getCalledFunction())) {
+            switch (Cxx) {
+            case CxxLock:
+            case CxxGuard:
+            case CxxJoin:       Mover = RightMover; break;
+            case CxxUnlock:
+            case CxxUnguard:
+            case CxxSpawn:      Mover = LeftMover; break;
+            default: ASSERT (false, "Missing case: "<< Cxx);
+            }
         } else if (Call->getCalledFunction()->getName().endswith(ATOMIC_BEGIN)) {
             assert (!ThreadF->getInstruction(Call).Atomic);
             Mover = RightMover; // force (dynamic) yield (for Post/Top)
@@ -1002,6 +1879,14 @@ struct Liptonize : public LiptonPass::Processor {
             return Call;
         } else if (Call->getCalledFunction()->getName().endswith("llvm.expect.i64")) {
             return Call;
+        } else if (Summary *S = Pass->Summaries->lookup (Call->getCalledFunction())) {
+            if (S->Mover != UnknownMover) {
+                Mover = S->Mover;
+            } else if (S->shared()) {
+                Mover = movable (LI, Call);
+            } else {
+                Mover = BothMover; // fresh or thread-local memory only
+            }
         } else {
             return nullptr;
         }
@@ -1037,12 +1922,15 @@ private:
         LI.Area = Area;
         LI.Mover = Mover;
 
-        addMetaData (I, name(Area), "");
+        LI.Notes |= note (Area);
         if (Mover != BothMover) {
-            addMetaData (I, name(Mover), "");
+            LI.Notes |= note (Mover);
         }
         if (LI.singleThreaded()) {
-            addMetaData (I, SINGLE_THREADED, "");
+            LI.Notes |= NOTE_SINGLE;
+        }
+        if (!Pass->opts.dryRun) {
+            annotate (I, LI.Notes);
         }
 
         if (Pass->opts.allYield && !I->isTerminator() && dyn_cast_or_null<PHINode>(I) == nullptr) {
@@ -1090,15 +1978,35 @@ private:
         PThreadType *PT = nullptr; // will store lock set if necessary
         assert (LI.PT != nullptr);
 
+        // Fences order memory, but do not change it: in the interleaving
+        // semantics of the reduction they commute with everything.
+        if (isa<FenceInst>(I)) return BothMover;
+
+        // Reads validated by the CAS of a retry loop: failed iterations are
+        // no-ops, a successful CAS observes the same value atomically.
+        if (Pass->RetryReads.count (I)) return BothMover;
+
+        mover_e Ordered = orderedMover (LI, I);
+        if (Ordered != UnknownMover) {
+            if (Pass->opts.verbose) errs () << "NOTICE: Ordered atomic "<< name(Ordered) <<": "<< *I << endll;
+            return Ordered;
+        }
+
+        if (LI.PT->locks() && guarded (LI, I)) {
+            if (Pass->opts.verbose) errs () << "NOTICE: Guarded instruction: "<< *I << endll;
+            return BothMover;
+        }
+
         for (pair<Function *, LLVMThread *> &X : Pass->Threads) {
             LLVMThread *T2 = X.second;
             if (T == T2 && T->isSingleton()) continue;
 
-            AliasSet *AS = FindAliasSetForUnknownInst (T2->Aliases, I);
-            if (AS == nullptr)  continue;
-			for (LLVMInstr *LJ : Pass->AS2I[AS]) {
+			for (LLVMInstr *LJ : Pass->aliasing (T2, I)) {
 				if (isCommutingAtomic(I, LJ->I)) continue;
 				if (!I->mayWriteToMemory() && !LJ->I->mayWriteToMemory()) continue;
+				if (disjointFields(&LI, LJ)) continue;
+				if (T == T2 && distinctInstances(T, &LI, LJ)) continue;
+				if (familyProtected(&LI, LJ)) continue;
 
 				conflict = true;
 	            if (!LI.PT->locks() || !LJ->PT->locks()) break;
@@ -1129,6 +2037,183 @@ private:
         return BothMover;
     }
 
+    /**
+     * C11 atomics weaker than seq_cst on a monotonic flag, i.e. all conflicting
+     * accesses are such atomics and every store writes the same constant.
+     * Flag stores commute with each other. A flag load only commutes with
+     * them when it spins until it reads the flag value (see spinExit); then
+     * the failed reads are no-ops and the successful read observes the
+     * final value, so it can be executed early (right mover).
+     */
+    mover_e
+    orderedMover (LLVMInstr &LI, Instruction *I)
+    {
+        Constant *Flag = nullptr;
+        if (!isWeakFlagAccess (I, Flag)) return UnknownMover;
+
+        bool conflict = false;
+        for (pair<Function *, LLVMThread *> &X : Pass->Threads) {
+            LLVMThread *T2 = X.second;
+            if (T2 == ThreadF && T2->isSingleton()) continue;
+
+            for (LLVMInstr *LJ : Pass->aliasing (T2, I)) {
+                if (!I->mayWriteToMemory() && !LJ->I->mayWriteToMemory()) continue;
+                if (disjointFields(&LI, LJ)) continue;
+                if (T2 == ThreadF && distinctInstances(T2, &LI, LJ)) continue;
+                if (!isWeakFlagAccess (LJ->I, Flag)) return UnknownMover;
+                if (isa<StoreInst>(I) && isa<StoreInst>(LJ->I)) continue; // same value
+                conflict = true;
+            }
+        }
+        if (!conflict) return BothMover;
+        SmallPtrSet<BasicBlock *, 4> Seen;
+        if (isa<LoadInst>(I) && spinExit (cast<LoadInst>(I), Flag, Seen)) return RightMover;
+        return UnknownMover;
+    }
+
+    /**
+     * L leaves a spin loop iff it reads Flag, and the retry path re-reads the
+     * flag without writing memory. The flag holds its initial value or Flag.
+     */
+    static bool
+    spinExit (LoadInst *L, Constant *Flag, SmallPtrSet<BasicBlock *, 4> &Seen)
+    {
+        BasicBlock *B = L->getParent();
+        BranchInst *Br = dyn_cast<BranchInst>(B->getTerminator());
+        ICmpInst *Cmp = Br != nullptr && Br->isConditional() ?
+                            dyn_cast<ICmpInst>(Br->getCondition()) : nullptr;
+        if (Cmp == nullptr || !Cmp->isEquality() || Cmp->getOperand(0) != L)
+            return false;
+        for (Instruction &I : *B) {
+            if (I.mayWriteToMemory()) return false;
+        }
+
+        // the successor taken iff L reads Flag
+        bool eq = Cmp->getPredicate() == ICmpInst::ICMP_EQ;
+        Constant *K = dyn_cast<Constant>(Cmp->getOperand(1));
+        GlobalVariable *G = dyn_cast<GlobalVariable>(L->getPointerOperand()->stripPointerCasts());
+        Constant *Init = G != nullptr && G->hasInitializer() ? G->getInitializer() : nullptr;
+        unsigned exit;
+        if (K != nullptr && K == Flag) {
+            exit = eq ? 0 : 1;
+        } else if (K != nullptr && K == Init) {
+            exit = eq ? 1 : 0;
+        } else {
+            return false;
+        }
+
+        Seen.insert (B);
+        return spinRetry (Br->getSuccessor(1 - exit), L->getPointerOperand(), Flag, Seen);
+    }
+
+    static bool
+    spinRetry (BasicBlock *B, Value *Ptr, Constant *Flag, SmallPtrSet<BasicBlock *, 4> &Seen)
+    {
+        if (!Seen.insert (B).second) return true; // back at a checked read
+        for (Instruction &I : *B) {
+            LoadInst *L = dyn_cast<LoadInst>(&I);
+            if (L != nullptr && L->getPointerOperand() == Ptr) return spinExit (L, Flag, Seen);
+            if (I.mayWriteToMemory()) return false;
+        }
+        BranchInst *Br = dyn_cast<BranchInst>(B->getTerminator());
+        return Br != nullptr && Br->isUnconditional() &&
+               spinRetry (Br->getSuccessor(0), Ptr, Flag, Seen);
+    }
+
+    static bool
+    isWeakFlagAccess (Instruction *I, Constant *&Flag)
+    {
+        if (LoadInst *L = dyn_cast<LoadInst>(I)) {
+            return L->isAtomic() && L->getOrdering() != SequentiallyConsistent;
+        }
+        StoreInst *S = dyn_cast<StoreInst>(I);
+        if (S == nullptr || !S->isAtomic() ||
+                S->getOrdering() == SequentiallyConsistent) {
+            return false;
+        }
+        Constant *C = dyn_cast<Constant>(S->getValueOperand());
+        if (C == nullptr || (Flag != nullptr && Flag != C)) return false;
+        Flag = C;
+        return true;
+    }
+
+    /**
+     * True if I holds a lock of the guard (see inferGuards) of every alias set
+     * it may access. This avoids the pairwise lock set intersection.
+     */
+    bool
+    guarded (LLVMInstr &LI, Instruction *I)
+    {
+        PThreadType *PT = new PThreadType (LI.PT); // copy
+        for (pair<Function *, LLVMThread *> &X : Pass->Threads) {
+            LLVMThread *T2 = X.second;
+            if (T2 == ThreadF && T2->isSingleton()) continue;
+
+            SmallVector<AliasSet *, 4> Sets;
+            Pass->aliasSets (T2->Aliases, I, Sets);
+            for (AliasSet *AS : Sets) {
+                PThreadType *Guard = Pass->Guards.lookup (AS);
+                if (Guard == nullptr) {
+                    delete PT;
+                    return false;
+                }
+                PT->eraseNonAlias (ReadLock, Guard);
+                PT->eraseNonAlias (TotalLock, Guard);
+            }
+        }
+        bool locked = PT->locks ();
+        delete PT;
+        return locked;
+    }
+
+    /**
+     * Cut point for the back edge to B. In a natural loop, any block that
+     * dominates all latches cuts the cycles through its header (inner loops
+     * are cut separately). Among these candidates (see classifyLoops), the
+     * commit of a retry loop, a cut of an inner loop and an existing yield
+     * make the cycle yield coincide. Otherwise, and for irreducible cycles
+     * (greedy DFS fallback), the cycle is cut at B.
+     */
+    Instruction *
+    cutPoint (BasicBlock &B)
+    {
+        if (Instruction *Cas = Pass->RetryLoops.lookup (&B)) return Cas;
+        Instruction *Head = getFirstNonTerminal (B.getFirstNonPHI());
+        auto It = Pass->LoopCuts.find (&B);
+        if (It == Pass->LoopCuts.end()) return Head;
+        Instruction *Yield = nullptr;
+        for (BasicBlock *C : It->second) {
+            for (Instruction &I : *C) {
+                block_e Type = isBlockStart (&I);
+                if (Type == NoBlock || Type == StartBlock) continue;
+                if (Type & LoopBlock) return &I;        // already cut
+                if (Yield == nullptr) Yield = &I;
+            }
+        }
+        return Yield != nullptr ? Yield : Head;
+    }
+
+    /**
+     * The loop headed by H is bounded (see classifyLoops) and all its
+     * (processed) shared accesses are both-movers: it needs no cycle yield.
+     */
+    bool
+    commutingLoop (BasicBlock &H)
+    {
+        auto It = Pass->BoundedLoops.find (&H);
+        if (It == Pass->BoundedLoops.end()) return false;
+        for (BasicBlock *B : It->second) {
+            for (Instruction &I : *B) {
+                if (isa<DbgInfoIntrinsic>(&I)) continue;
+                if (!I.mayReadOrWriteMemory() && !isa<CallInst>(&I)) continue;
+                LLVMInstr &LI = ThreadF->getInstruction(&I);
+                if (LI.singleThreaded()) continue;
+                if (LI.Mover != BothMover) return false; // also unprocessed
+            }
+        }
+        return true;
+    }
+
     /**
      * Creates a block for this instruction (yield / commit before instruction).
      */
@@ -1194,14 +2279,17 @@ LiptonPass::walkGraph ( Instruction *I )
         handle->process (I);
         for (int i = 0, num = T->getNumSuccessors(); i < num; ++i) {
             BasicBlock *B = T->getSuccessor(i);
+            handle->edge (T, i, true);
             walkGraph (*B);
+            handle->edge (T, i, false);
         }
         return;
     }
 
     if (CallInst *Call = dyn_cast<CallInst>(I)) {
         Function *Callee = Call->getCalledFunction ();
-        if (!Callee->isIntrinsic() && !Callee->isDeclaration()) {
+        if (!Callee->isIntrinsic() && !Callee->isDeclaration() &&
+                cxxPrimitive (Callee) == CxxNone) {
             walkGraph (*Callee);
         } else {
            Instruction *Next = handle->handleCall (Call);
@@ -1305,6 +2393,7 @@ obtainFixedCasValue (SmallVector<AtomicCmpXchgInst *, 8> &cs,
  * The following format is used: '__act(t_1, n_11,..., t2, n_21,....  )',
  * where t_x is a function pointer to the thread's functions and
  * { n_xy | y in N } is the set of conflicting blocks in that thread
+ * (see refineActs for the final encoding).
  */
 bool
 LiptonPass::conflictingNonMovers (SmallVector<Value *, 8> &sv,
@@ -1317,19 +2406,19 @@ LiptonPass::conflictingNonMovers (SmallVector<Value *, 8> &sv,
         LLVMThread *T2 = Thread.second;
         if (T2 == T && T->isSingleton()) continue;
 
-        AliasSet *AS = FindAliasSetForUnknownInst (T2->Aliases, I);
-        if (AS == nullptr) continue;
-
         DenseSet<int> Blocks;
         // for all conflicting J
-        for (LLVMInstr *LJ : AS2I[AS]) {
+        for (LLVMInstr *LJ : aliasing (T2, I)) {
             if (isCommutingAtomic(I, LJ->I)) continue;
             if (!I->mayWriteToMemory() && !LJ->I->mayWriteToMemory()) continue;
+            if (disjointFields(T->Instructions.lookup(I), LJ)) continue;
+            if (T2 == T && distinctInstances(T, T->Instructions.lookup(I), LJ)) continue;
+            if (familyProtected(T->Instructions.lookup(I), LJ)) continue;
 
             if (Is != nullptr) Is->push_back(LJ);
 
-            // for all Block starting points TODO: refine to exit points
-            for (pair<Instruction *, pair<block_e, int> > X : T2->BlockStarts) {
+            // for all Block starting points (refined by refineActs)
+            for (pair<Instruction *, pair<block_e, int> > X : T2->orderedStarts()) {
                 Instruction *R = X.first;
                 int         blockID = X.second.second;
                 //errs () << *I << endll <<*J << endll << *R <<" ++++++ "<< *R->getNextNode() << endll;
@@ -1359,86 +2448,484 @@ LiptonPass::conflictingNonMovers (SmallVector<Value *, 8> &sv,
     return staticYield;
 }
 
-static void
-insertYield (Instruction* I, Function *YieldF, int block)
+/**
+ * Eraser-style lock set inference. For each alias set, intersects the locks
+ * held at all its accesses (over all threads). The result guards the set.
+ * Written sets without a consistent lock are reported.
+ */
+void
+LiptonPass::inferGuards ()
 {
-    Value *blockId = ConstantInt::get (YieldF->getFunctionType ()->getParamType (0), block);
-    CallInst::Create (YieldF, blockId, "", I);
+    for (pair<AliasSet *, list<LLVMInstr *>> &X : AS2I) {
+        PThreadType *Guard = nullptr;
+        bool writes = false;
+        for (LLVMInstr *LI : X.second) {
+            writes |= LI->I->mayWriteToMemory();
+            if (Guard == nullptr) {
+                Guard = new PThreadType (LI->PT); // copy
+            } else {
+                Guard->eraseNonAlias (ReadLock, LI->PT);
+                Guard->eraseNonAlias (TotalLock, LI->PT);
+            }
+        }
+        if (Guard == nullptr) continue;
+        Guards[X.first] = Guard;
+
+        if (writes && !Guard->locks()) {
+            errs () << "UNGUARDED: no consistent lock for accesses:" << endll;
+            for (LLVMInstr *LI : X.second) {
+                errs () << "\t"<< LI->I->getParent()->getParent()->getName()
+                        << ": " << *LI->I << endll;
+            }
+        } else if (opts.verbose && Guard->locks()) {
+            errs () << "GUARDED: " << *X.second.front()->I << endll;
+            Guard->print (true, true, false);
+        }
+    }
 }
 
-bool
-leftMoverInSCC (LLVMSCC *SCC)
+static const int MAX_INSTANCES = 1 << 16; // beyond: unbounded
+
+/**
+ * Number of times the spawn site executes per instance of its thread: the
+ * product of the trip counts of the loops around it (SCEV), or -1. Exact if
+ * all trip counts are known and the spawn executes in every iteration.
+ */
+int
+LiptonPass::spawnTrips (CallInst *Spawn, bool &Exact)
 {
-    for (LLVMInstr *LI : SCC->Insts) {
-        if (LI->Mover == LeftMover) {
-            return true;
+    BasicBlock *B = Spawn->getParent();
+    Function &F = *B->getParent();
+    LoopInfo &LI = getAnalysis<LoopInfo>(F);
+    ScalarEvolution &SE = getAnalysis<ScalarEvolution>(F);
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+
+    Exact = true;
+    Loop *L = LI.getLoopFor (B);
+    if (L == nullptr) {
+        LLVMThread *T = Threads.lookup (&F);
+        if (T != nullptr && T->getInstruction(Spawn).SCC->Loops) {
+            return -1; // irreducible cycle
         }
+        return 1;
     }
-    return false;
+
+    int64_t Trips = 1;
+    for (; L != nullptr; L = L->getParentLoop()) {
+        const SCEVConstant *Max = dyn_cast<SCEVConstant>(SE.getMaxBackedgeTakenCount(L));
+        if (Max == nullptr) return -1;
+        const APInt &Backedges = Max->getValue()->getValue();
+        if (Backedges.uge (MAX_INSTANCES)) return -1; // also for i64 -1 + 1
+        Trips *= Backedges.getZExtValue() + 1; // both factors <= MAX_INSTANCES
+        if (Trips > MAX_INSTANCES) return -1;
+
+        const SCEVConstant *Count = dyn_cast<SCEVConstant>(SE.getBackedgeTakenCount(L));
+        BasicBlock *Latch = L->getLoopLatch();
+        Exact &= Count == Max && Latch != nullptr && DT.dominates(B, Latch);
+    }
+    return Trips;
 }
 
-bool
-LLVMSCC::hasLeftMovers ()
+/**
+ * Counts the instances of T: for each spawn site, the instances of the
+ * spawning thread times the trips of the spawn site. Cached in T->Runs.
+ */
+int
+LiptonPass::countInstances (LLVMThread *T)
 {
-    if (hasLeft == -1)
-        hasLeft = leftMoverInSCC (this);
-    return hasLeft;
+    if (T->Runs != -2) return T->Runs;
+    T->Runs = -1; // recursive spawning is unbounded
+
+    int64_t Runs = 0;
+    bool Exact = true;
+    for (CallInst *C : T->Starts) {
+        if (C == nullptr) { // MAIN
+            Runs++;
+            continue;
+        }
+        LLVMThread *Starter = Threads.lookup (C->getParent()->getParent());
+        if (Starter == nullptr) return -1;
+        int StarterRuns = countInstances (Starter);
+        bool TripsExact;
+        int Trips = spawnTrips (C, TripsExact);
+        if (StarterRuns == -1 || Trips == -1) {
+            errs () << "THREAD: " << T->F.getName () << " (Potentially infinite)" << endll << *C << endll;
+            return -1;
+        }
+        Runs += (int64_t) StarterRuns * Trips;
+        Exact &= Starter->RunsExact && TripsExact;
+        if (Runs > MAX_INSTANCES) return -1;
+    }
+    T->Runs = Runs;
+    T->RunsExact = Exact;
+    return Runs;
 }
 
-static void
-insertLoopYields (LLVMInstr &NM, Instruction *I, int block,
-                  AllocaInst* Phase)
+void
+LiptonPass::countInstances ()
 {
-    if (NM.Area == Top && NM.SCC->hasLeftMovers()) {
-        TerminatorInst *ThenTerm;
-        TerminatorInst *ElseTerm;
-        LoadInst *P = new LoadInst (Phase, "", I);
-        SplitBlockAndInsertIfThenElse (P, I, &ThenTerm, &ElseTerm);
-
-        // then (post)
-        new StoreInst (PRECOMMIT, Phase, ThenTerm);
-        insertYield (ThenTerm, YieldGlobal, block);
-
-        // else (pre)
-        insertYield (ElseTerm, YieldLocal, block);
-    } else if (NM.Area == Post) {
-        new StoreInst (PRECOMMIT, Phase, I);
-        insertYield (I, YieldGlobal, block);
-    } else {
-        insertYield (I, YieldLocal, block);
+    for (pair<Function *, LLVMThread *> &X : Threads) {
+        LLVMThread *T = X.second;
+        countInstances (T);
+        if (opts.verbose) {
+            errs () << "THREAD: " << T->F.getName() << " instances: " << T->Runs
+                    << (T->RunsExact ? " (exact)" : " (bound)") << endll;
+        }
     }
 }
 
-static TerminatorInst *
-insertDynYield (LLVMInstr &NM, Instruction *Before, Value *Cond,
-                block_e type, int block, AllocaInst *Phase)
+static void
+spawnPayload (CallInst *Spawn, SmallVector<Value *, 4> &Payload)
 {
-    TerminatorInst *ThenTerm;
-    TerminatorInst *ElseTerm;
-    if (type & LoopBlock) {
-        SplitBlockAndInsertIfThenElse (Cond, Before, &ThenTerm, &ElseTerm);
-        insertLoopYields (NM, ElseTerm, block, Phase);
+    if (cxxPrimitive (Spawn->getCalledFunction()) == CxxSpawn) {
+        for (unsigned i = 2; i < Spawn->getNumArgOperands(); i++)
+            Payload.push_back (Spawn->getArgOperand(i));
     } else {
-        ThenTerm = SplitBlockAndInsertIfThen (Cond, Before, false);
+        Payload.push_back (Spawn->getArgOperand(PTHREAD_CREATE_F_IDX + 1));
     }
-    return ThenTerm;
 }
 
-void
-checkAssert (bool v, Instruction *I, AllocaInst* Phase, area_e Area)
+/**
+ * The payload of a single spawn site in a single, top-level loop of a thread
+ * with one instance, of the form &base[..][i] with i an induction variable of
+ * step one, gives each instance its own slot. Returns the slot pointer type.
+ */
+Type *
+LiptonPass::payloadSlots (LLVMThread *T)
 {
-    if (!v) return;
+    if (T->Starts.size() != 1 || T->Starts[0] == nullptr) return nullptr;
+    CallInst *Spawn = T->Starts[0];
+    if (cxxPrimitive (Spawn->getCalledFunction()) == CxxSpawn) return nullptr;
+
+    Function &F = *Spawn->getParent()->getParent();
+    LLVMThread *Starter = Threads.lookup (&F);
+    if (Starter == nullptr || !Starter->RunsExact || Starter->Runs != 1) return nullptr;
+
+    LoopInfo &LI = getAnalysis<LoopInfo>(F);
+    Loop *L = LI.getLoopFor (Spawn->getParent());
+    if (L == nullptr || L->getParentLoop() != nullptr) return nullptr;
+
+    Value *Arg = Spawn->getArgOperand(PTHREAD_CREATE_F_IDX + 1);
+    while (isPointerCast (Arg)) Arg = cast<Operator>(Arg)->getOperand (0);
+    GEPOperator *GEP = dyn_cast<GEPOperator>(Arg);
+    if (GEP == nullptr || GEP->getNumIndices() == 0) return nullptr;
+    for (unsigned i = 1; i < GEP->getNumIndices(); i++) { // all but last
+        if (!isa<ConstantInt>(GEP->getOperand(i))) return nullptr;
+    }
 
-    Instruction *P = new LoadInst (Phase, "", I);
-    if (Area == Pre)
-        P = new ICmpInst(I, CmpInst::Predicate::ICMP_EQ,  P, PRECOMMIT);
-    CallInst::Create (Assert, P, "", I);
+    ScalarEvolution &SE = getAnalysis<ScalarEvolution>(F);
+    Value *Index = GEP->getOperand (GEP->getNumIndices());
+    if (!SE.isSCEVable (Index->getType())) return nullptr;
+    const SCEVAddRecExpr *Rec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV (Index));
+    if (Rec == nullptr || Rec->getLoop() != L || !Rec->isAffine()) return nullptr;
+    const SCEVConstant *Step = dyn_cast<SCEVConstant>(Rec->getStepRecurrence (SE));
+    if (Step == nullptr || !(Step->getValue()->isOne() || Step->getValue()->isMinusOne()))
+        return nullptr;
+    return GEP->getType();
 }
 
-Instruction *
+/**
+ * Cond holds iff Cas succeeded, or iff it failed when Neg is set.
+ */
+static bool
+casSucceeded (Value *Cond, AtomicCmpXchgInst *Cas, bool &Neg)
+{
+    Neg = false;
+    while (true) {
+        if (ExtractValueInst *EV = dyn_cast<ExtractValueInst>(Cond)) {
+            return EV->getAggregateOperand() == Cas && EV->getNumIndices() == 1 &&
+                   EV->getIndices()[0] == 1;
+        } else if (isa<ZExtInst>(Cond) || isa<TruncInst>(Cond)) {
+            Cond = cast<CastInst>(Cond)->getOperand(0);
+        } else if (ICmpInst *Cmp = dyn_cast<ICmpInst>(Cond)) {
+            if (!Cmp->isEquality()) return false;
+            if (Cmp->getPredicate() == ICmpInst::ICMP_NE) Neg = !Neg;
+            ExtractValueInst *EV = dyn_cast<ExtractValueInst>(Cmp->getOperand(0));
+            if (EV && EV->getAggregateOperand() == Cas && EV->getIndices()[0] == 0) {
+                return Cmp->getOperand(1) == Cas->getCompareOperand(); // old == expected
+            }
+            ConstantInt *Zero = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+            if (Zero == nullptr || !Zero->isZero()) return false;
+            Neg = !Neg; // x == 0  <=>  !x
+            Cond = Cmp->getOperand(0);
+        } else {
+            return false;
+        }
+    }
+}
+
+/**
+ * A retry loop of L has one CAS (not a spin lock) that dominates all latches,
+ * exits only when the CAS succeeds and on failure only writes thread-local or
+ * fresh (allocated) memory. Loads feeding the expected value of the CAS from
+ * the same location are recorded as validated reads.
+ */
+bool
+LiptonPass::retryLoop (Loop *L, DominatorTree &DT)
+{
+    if (!L->empty()) return false; // innermost only
+
+    AtomicCmpXchgInst *Cas = nullptr;
+    for (BasicBlock *B : L->getBlocks()) {
+        for (Instruction &I : *B) {
+            if (AtomicCmpXchgInst *C = dyn_cast<AtomicCmpXchgInst>(&I)) {
+                if (Cas != nullptr) return false;
+                Cas = C;
+            } else if (isa<AtomicRMWInst>(&I)) {
+                return false;
+            } else if (StoreInst *Store = dyn_cast<StoreInst>(&I)) {
+                Value *Obj = GetUnderlyingObject (Store->getPointerOperand());
+                if (!isa<AllocaInst>(Obj) && !isNoAliasCall(Obj)) return false;
+                if (Store->isAtomic()) return false;
+            } else if (CallInst *Call = dyn_cast<CallInst>(&I)) {
+                if (!isa<DbgInfoIntrinsic>(Call) && !Call->onlyReadsMemory())
+                    return false;
+            }
+        }
+    }
+    if (Cas == nullptr) return false;
+    if (isa<Constant>(Cas->getCompareOperand()) && isa<Constant>(Cas->getNewValOperand()))
+        return false; // spin lock (see LockSearch)
+
+    SmallVector<BasicBlock *, 4> Blocks;
+    L->getLoopLatches (Blocks);
+    for (BasicBlock *Latch : Blocks) {
+        if (!DT.dominates (Cas->getParent(), Latch)) return false;
+    }
+    Blocks.clear ();
+    L->getExitingBlocks (Blocks);
+    for (BasicBlock *Exiting : Blocks) {
+        BranchInst *Br = dyn_cast<BranchInst>(Exiting->getTerminator());
+        bool Neg;
+        if (Br == nullptr || !Br->isConditional() ||
+                !casSucceeded (Br->getCondition(), Cas, Neg)) {
+            return false;
+        }
+        if (L->contains (Br->getSuccessor (Neg ? 0 : 1)) == false ||
+                L->contains (Br->getSuccessor (Neg ? 1 : 0))) {
+            return false; // exit on success, retry on failure
+        }
+    }
+
+    RetryLoops[L->getHeader()] = Cas;
+    AliasAnalysis::Location CasLoc = AA->getLocation (Cas);
+    Value *Expected = Cas->getCompareOperand();
+    while (isPointerCast (Expected) || isa<PtrToIntInst>(Expected))
+        Expected = cast<Operator>(Expected)->getOperand (0);
+    if (LoadInst *Load = dyn_cast<LoadInst>(Expected)) {
+        if (L->contains (Load) &&
+                AA->alias (AA->getLocation (Load), CasLoc) == AliasAnalysis::MustAlias) {
+            RetryReads.insert (Load);
+        }
+    }
+    return true;
+}
+
+/**
+ * Flanagan/Qadeer: the failed iterations of a CAS retry loop are no-ops, so
+ * its cycle is closed at the CAS (one commit yield) instead of at the header.
+ * Loops with a SCEV-bounded trip count are recorded with their blocks; if
+ * they also commute, Liptonize drops their cycle yield (see commutingLoop).
+ * For every loop, the blocks that may cut its cycles are recorded (see
+ * Liptonize::cutPoint).
+ */
+void
+LiptonPass::classifyLoops (Module &M)
+{
+    for (Function &F : M) {
+        if (F.isDeclaration()) continue;
+        LoopInfo &LI = getAnalysis<LoopInfo>(F);
+        DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+        ScalarEvolution &SE = getAnalysis<ScalarEvolution>(F);
+        SmallVector<Loop *, 8> Work(LI.begin(), LI.end());
+        while (!Work.empty()) {
+            Loop *L = Work.pop_back_val ();
+            Work.append (L->begin(), L->end());
+            if (retryLoop (L, DT) && opts.verbose) {
+                errs () << "NOTICE: CAS retry loop: "<< *RetryLoops[L->getHeader()] << endll;
+            }
+            if (!isa<SCEVCouldNotCompute>(SE.getMaxBackedgeTakenCount (L))) {
+                BoundedLoops[L->getHeader()] = L->getBlocks();
+            }
+
+            // Cut candidates: the dominator tree path from the header to the
+            // nearest common dominator of the latches
+            SmallVector<BasicBlock *, 4> Latches;
+            L->getLoopLatches (Latches);
+            if (Latches.empty()) continue;
+            BasicBlock *NCD = Latches[0];
+            for (BasicBlock *Latch : Latches) {
+                NCD = DT.findNearestCommonDominator (NCD, Latch);
+            }
+            vector<BasicBlock *> &Cuts = LoopCuts[L->getHeader()];
+            for (DomTreeNode *N = DT.getNode (NCD); N != nullptr; N = N->getIDom()) {
+                Cuts.push_back (N->getBlock());
+                if (N->getBlock() == L->getHeader()) break;
+            }
+        }
+    }
+}
+
+/**
+ * A payload value that is the same for all instances up to the thread id:
+ * a constant that is not a pointer to memory (a shared pointee may be
+ * initialized differently for each instance), or an induction variable (the
+ * id) of the spawn loop, possibly cast to a pointer.
+ */
+static bool
+plainPayload (ScalarEvolution &SE, Value *V, Value *First)
+{
+    if (isa<Constant>(V)) {
+        return V == First && (!V->getType()->isPointerTy() || isa<ConstantPointerNull>(V) ||
+                              Operator::getOpcode (V) == Instruction::IntToPtr);
+    }
+    while (isPointerCast (V) || Operator::getOpcode (V) == Instruction::IntToPtr)
+        V = cast<Operator>(V)->getOperand (0);
+    return V->getType()->isIntegerTy() && isa<SCEVAddRecExpr>(SE.getSCEV (V));
+}
+
+/**
+ * Instances of a thread are symmetric if their payloads are indistinguishable
+ * up to the thread id, i.e. consist of plain values only (see plainPayload).
+ * Pointers to per-instance slots are not, since the slots may hold anything,
+ * but they still make the instances access distinct data (see payloadSlots).
+ */
+void
+LiptonPass::detectSymmetry (Module &M)
+{
+    for (pair<Function *, LLVMThread *> &X : Threads) {
+        LLVMThread *T = X.second;
+        if (T->Runs == 1) continue;
+
+        T->SlotType = payloadSlots (T);
+        if (T->SlotType != nullptr) {
+            errs () << "DISTINCT PAYLOADS: " << T->F.getName() << endll;
+        }
+
+        SmallVector<Value *, 4> First;
+        bool symmetric = true;
+        for (CallInst *Spawn : T->Starts) {
+            if (Spawn == nullptr) { symmetric = false; break; }
+            SmallVector<Value *, 4> Payload;
+            spawnPayload (Spawn, Payload);
+            if (First.empty()) First = Payload;
+            if (First.size() != Payload.size()) { symmetric = false; break; }
+
+            ScalarEvolution &SE = getAnalysis<ScalarEvolution>(*Spawn->getParent()->getParent());
+            for (unsigned i = 0; i < Payload.size() && symmetric; i++) {
+                symmetric = plainPayload (SE, Payload[i], First[i]);
+            }
+            if (!symmetric) break;
+        }
+        if (!symmetric) continue;
+
+        T->Symmetric = true;
+        errs () << "SYMMETRIC: " << T->F.getName() << " instances: " << T->Runs << endll;
+    }
+}
+
+/**
+ * Emits the symmetric threads (see detectSymmetry) as named module metadata:
+ * !lipton.symmetry = !{ !{thread, instances (-1: unbounded)} }
+ */
+void
+LiptonPass::emitSymmetry (Module &M)
+{
+    LLVMContext &Ctx = M.getContext();
+    NamedMDNode *Classes = M.getOrInsertNamedMetadata (SYMMETRY);
+
+    for (pair<Function *, LLVMThread *> &X : Threads) {
+        LLVMThread *T = X.second;
+        if (!T->Symmetric) continue;
+
+        Metadata *Ops[] = {
+            ValueAsMetadata::get (&T->F),
+            ConstantAsMetadata::get (ConstantInt::get (Int64, T->Runs, true)),
+        };
+        Classes->addOperand (MDNode::get (Ctx, Ops));
+    }
+}
+
+static void
+insertYield (Instruction* I, Function *YieldF, int block)
+{
+    Value *blockId = ConstantInt::get (YieldF->getFunctionType ()->getParamType (0), block);
+    CallInst::Create (YieldF, blockId, "", I);
+}
+
+bool
+leftMoverInSCC (LLVMSCC *SCC)
+{
+    for (LLVMInstr *LI : SCC->Insts) {
+        if (LI->Mover == LeftMover) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+LLVMSCC::hasLeftMovers ()
+{
+    if (hasLeft == -1)
+        hasLeft = leftMoverInSCC (this);
+    return hasLeft;
+}
+
+static void
+insertLoopYields (LLVMInstr &NM, Instruction *I, int block,
+                  AllocaInst* Phase)
+{
+    if (NM.Area == Top && NM.SCC->hasLeftMovers()) {
+        TerminatorInst *ThenTerm;
+        TerminatorInst *ElseTerm;
+        LoadInst *P = new LoadInst (Phase, "", I);
+        SplitBlockAndInsertIfThenElse (P, I, &ThenTerm, &ElseTerm);
+
+        // then (post)
+        new StoreInst (PRECOMMIT, Phase, ThenTerm);
+        insertYield (ThenTerm, YieldGlobal, block);
+
+        // else (pre)
+        insertYield (ElseTerm, YieldLocal, block);
+    } else if (NM.Area == Post) {
+        new StoreInst (PRECOMMIT, Phase, I);
+        insertYield (I, YieldGlobal, block);
+    } else {
+        insertYield (I, YieldLocal, block);
+    }
+}
+
+static TerminatorInst *
+insertDynYield (LLVMInstr &NM, Instruction *Before, Value *Cond,
+                block_e type, int block, AllocaInst *Phase)
+{
+    TerminatorInst *ThenTerm;
+    TerminatorInst *ElseTerm;
+    if (type & LoopBlock) {
+        SplitBlockAndInsertIfThenElse (Cond, Before, &ThenTerm, &ElseTerm);
+        insertLoopYields (NM, ElseTerm, block, Phase);
+    } else {
+        ThenTerm = SplitBlockAndInsertIfThen (Cond, Before, false);
+    }
+    return ThenTerm;
+}
+
+void
+checkAssert (bool v, Instruction *I, AllocaInst* Phase, area_e Area)
+{
+    if (!v) return;
+
+    Instruction *P = new LoadInst (Phase, "", I);
+    if (Area == Pre)
+        P = new ICmpInst(I, CmpInst::Predicate::ICMP_EQ,  P, PRECOMMIT);
+    CallInst::Create (Assert, P, "", I);
+}
+
+Instruction *
 LiptonPass::addFixedCAS (LLVMInstr &LI, block_e type, int block,
                          Instruction *NextTerm, SmallVector<LLVMInstr *, 8> &Is,
-                         AllocaInst *Phase)
+                         AllocaInst *Phase, SmallVectorImpl<Value *> &Checks)
 {
     // First collect conflicting non-movers from other threads
     SmallVector<AtomicCmpXchgInst *, 8> cs;
@@ -1462,6 +2949,7 @@ LiptonPass::addFixedCAS (LLVMInstr &LI, block_e type, int block,
         }
         NextTerm = insertDynYield (LI, NextTerm, ValChecks, type, block, Phase);
         addMetaData (ValChecks, DYN_YIELD_CONDITION, "");
+        Checks.push_back (ValChecks);
     }
     return NextTerm;
 }
@@ -1477,6 +2965,8 @@ LiptonPass::obtainFixedPtr (LLVMInstr &LI)
         Ptr = S->getPointerOperand();
     } else if (CallInst *C = dyn_cast_or_null<CallInst>(LI.I)) { // lock
         Ptr = C->getOperand(0);
+    } else if (Value *P = getAccessPointer (LI.I)) { // spinlock
+        Ptr = P;
     } else {
         return nullptr;
     }
@@ -1540,63 +3030,99 @@ LiptonPass::obtainFixedPtrValue (SmallVector<Value *, 8> &cs,
     return !cs.empty();
 }
 
-LLVMInstr *
-LiptonPass::lockPointers (SmallVector<Value *, 8> &pts,
-                          SmallVector<LLVMInstr *, 8> &Is, LLVMInstr &LI)
+static const int      MAX_LOCK_LOADS = 2;      // loads to rematerialize a lock pointer
+static const unsigned MAX_LOCK_COMPARES = 16;  // compares in a dynamic lock check
+
+/**
+ * A lock pointer can be recomputed at a yield if it is rooted in a constant
+ * (global or GEP of one) or in an argument of the function holding the yield
+ * (Own), through at most depth loads, constant GEPs and casts.
+ */
+static bool
+rematerializable (Value *V, Function *Own, int depth)
 {
-    LLVMThread *T = LI.SCC->T;
+    if (depth < 0) return false;
+    if (isa<Constant>(V)) return true;
+    if (Argument *A = dyn_cast<Argument>(V)) return A->getParent() == Own;
+    if (LoadInst *L = dyn_cast<LoadInst>(V))
+        return rematerializable (L->getPointerOperand(), Own, depth - 1);
+    if (GetElementPtrInst *G = dyn_cast<GetElementPtrInst>(V))
+        return G->hasAllConstantIndices() &&
+               rematerializable (G->getPointerOperand(), Own, depth);
+    if (CastInst *C = dyn_cast<CastInst>(V))
+        return rematerializable (C->getOperand(0), Own, depth);
+    return false;
+}
+
+static Value *
+rematerialize (Value *V, Instruction *Before)
+{
+    if (isa<Constant>(V) || isa<Argument>(V)) return V;
+    if (LoadInst *L = dyn_cast<LoadInst>(V))
+        return new LoadInst (rematerialize (L->getPointerOperand(), Before), "", Before);
+    if (GetElementPtrInst *G = dyn_cast<GetElementPtrInst>(V)) {
+        SmallVector<Value *, 4> Idx (G->idx_begin(), G->idx_end());
+        return GetElementPtrInst::Create (rematerialize (G->getPointerOperand(), Before),
+                                          Idx, "", Before);
+    }
+    CastInst *C = cast<CastInst>(V);
+    return CastInst::Create (C->getOpcode(), rematerialize (C->getOperand(0), Before),
+                             C->getType(), "", Before);
+}
 
-    PThreadType *PT = new PThreadType (true);
+static Value *
+lockPtr (Value *V, Instruction *Before)
+{
+    Type *I8P = Type::getInt8PtrTy (V->getContext());
+    if (V->getType() == I8P) return V;
+    return CastInst::CreatePointerCast (V, I8P, "", Before);
+}
+
+/**
+ * Collects the (rematerializable) write locks held by LI (Mine) and, per
+ * distinct lock set, those held by the conflicting instructions (Others).
+ * Dropping locks that cannot be rematerialized is conservative (more yields).
+ */
+bool
+LiptonPass::lockPointers (SmallVector<Value *, 4> &Mine,
+                          vector<SmallVector<Value *, 4>> &Others,
+                          SmallVector<LLVMInstr *, 8> &Is, LLVMInstr &LI)
+{
+    Function *Own = LI.I->getParent()->getParent(); // the yield goes before LI
     assert (LI.PT != nullptr);
 
-    if (!LI.PT->locks1()) return nullptr;
+    for (PTCallType &Lock : LI.PT->getWriteLocks()) {
+        Value *V = lockOperand (Lock.second);
+        if (rematerializable (V, Own, MAX_LOCK_LOADS)) Mine.push_back (V);
+    }
+    if (Mine.empty()) return false;
 
+    unsigned compares = 0;
     for (LLVMInstr *LJ : Is) {
         if (LI.I == LJ->I) continue;
 
-        LLVMThread *T2 = LJ->SCC->T;
-
-        if (!LJ->PT->locks1()) return nullptr;
-
-        if (PTCallType *CT = PT->merge1 (LJ->PT)) {
-            LLVMInstr &Call = T2->getInstruction (CT->second);
-            Value *V = obtainFixedPtr(Call);
-
-            Value *G;
-            if (LoadInst *L = dyn_cast_or_null<LoadInst>(V)) {
-               G = L->getPointerOperand();
-            } else if (StoreInst *S = dyn_cast_or_null<StoreInst>(V)) {
-                G = S->getPointerOperand();
-            } else {
-                return nullptr;
-            }
-            GlobalVariable *GV = dyn_cast_or_null<GlobalVariable>(G);
-
-            if (GV == nullptr) {
-                errs () <<"NO LOCK PTR: " << *Call.I << endll;
-                return nullptr;
-            } else {
-                errs () <<"FOUND LOCK PTR: " << *GV << endll;
-            }
-            bool found = false;
-            for (Value *GV2 : pts) {
-                if (GV2 == GV) {break; found = true; }
-            }
-            if (!found) pts.push_back (GV);
+        SmallVector<Value *, 4> Theirs;
+        for (PTCallType &Lock : LJ->PT->getWriteLocks()) {
+            Value *V = lockOperand (Lock.second);
+            if (rematerializable (V, nullptr, MAX_LOCK_LOADS)) Theirs.push_back (V);
         }
-    }
-    delete PT;
+        if (Theirs.empty()) {
+            errs () <<"NO LOCK PTR: " << *LJ->I << endll;
+            return false;
+        }
+        if (find (Others.begin(), Others.end(), Theirs) != Others.end()) continue;
 
-    LLVMInstr &Call = T->getInstruction (LI.PT->get1Lock()->second);
-    return &Call;
+        compares += Mine.size() * Theirs.size();
+        if (compares > MAX_LOCK_COMPARES) return false;
+        Others.push_back (Theirs);
+    }
+    return !Others.empty();
 }
 
-
-
 Instruction *
 LiptonPass::addStaticPtr (LLVMInstr &LI, block_e type, int block,
                          Instruction *NextTerm, SmallVector<LLVMInstr *, 8> &Is,
-                         AllocaInst *Phase)
+                         AllocaInst *Phase, SmallVectorImpl<Value *> &Checks)
 {
     if (opts.nodyn) return NextTerm;
 
@@ -1607,28 +3133,35 @@ LiptonPass::addStaticPtr (LLVMInstr &LI, block_e type, int block,
     if (!fixedPTR) {
         if (opts.nolock) return NextTerm;
 
-        SmallVector<LLVMInstr *, 8> pts;
-        LLVMInstr *Ptr = lockPointers (cs, Is, LI);
-        if (Ptr == nullptr) return NextTerm;
-
-        Value *Ptr1 = obtainFixedPtr (*Ptr);
-
-        Value       *ValChecks = FALSE;
-        Instruction *PtrI1 = dyn_cast_or_null<Instruction>(Ptr1);
-        for (Value *Ptr2 : cs) {
-            GlobalVariable *V = dyn_cast_or_null<GlobalVariable>(Ptr2);
-            assert (V);
-            errs () << "LOCK PTR: " << *Ptr1 << " <--> " << *Ptr2 << endll;
-            Instruction *Load = new LoadInst(V, "", PtrI1);
-            Instruction *New = new ICmpInst (NextTerm, CmpInst::Predicate::ICMP_NE,
-                                             Ptr1, Load);
+        SmallVector<Value *, 4> Mine;
+        vector<SmallVector<Value *, 4>> Others;
+        if (!lockPointers (Mine, Others, Is, LI)) return NextTerm;
 
+        // yield iff some conflicting thread holds none of my locks
+        SmallVector<Value *, 4> MyPtrs;
+        for (Value *V : Mine) {
+            MyPtrs.push_back (lockPtr (rematerialize (V, NextTerm), NextTerm));
+        }
+        Value *ValChecks = FALSE;
+        for (SmallVector<Value *, 4> &Theirs : Others) {
+            Value *Unprotected = TRUE;
+            for (Value *V : Theirs) {
+                Value *Their = lockPtr (rematerialize (V, NextTerm), NextTerm);
+                for (Value *My : MyPtrs) {
+                    errs () << "LOCK PTR: " << *My << " <--> " << *Their << endll;
+                    Instruction *New = new ICmpInst (NextTerm, CmpInst::Predicate::ICMP_NE,
+                                                     My, Their);
+                    Unprotected = BinaryOperator::Create (BinaryOperator::BinaryOps::And,
+                                                          Unprotected, New, "", NextTerm);
+                }
+            }
             BinaryOperator *ValChecksB = BinaryOperator::Create (BinaryOperator::BinaryOps::Or,
-                                                                 ValChecks, New, "", NextTerm);
+                                                                 ValChecks, Unprotected, "", NextTerm);
             addMetaData (ValChecksB, DYN_YIELD_CONDITION, "");
             ValChecks = ValChecksB;
         }
         NextTerm = insertDynYield (LI, NextTerm, ValChecks, type, block, Phase);
+        Checks.push_back (ValChecks);
 
         return NextTerm;
     }
@@ -1651,10 +3184,114 @@ LiptonPass::addStaticPtr (LLVMInstr &LI, block_e type, int block,
     }
     NextTerm = insertDynYield (LI, NextTerm, ValChecks, type, block, Phase);
     addMetaData (ValChecks, DYN_YIELD_CONDITION, "");
+    Checks.push_back (ValChecks);
 
     return NextTerm;
 }
 
+/**
+ * Applies a yield plan (see YieldPlan.h) instead of Liptonize: restores the
+ * block starts of each thread with the mover, area and atomicity of their
+ * instructions, and the movers, areas and annotations of all others. The
+ * plan must stem from the same (uninstrumented) code, i.e. carry its Digest,
+ * and cover every thread.
+ */
+bool
+LiptonPass::applyPlan (Module &M, YieldPlan &Plan, const string &Digest)
+{
+    if (Plan.Digest != Digest) {
+        errs () << "ERROR: Yield plan stems from other code (digest "<< Plan.Digest
+                <<", expected "<< Digest <<")" << endll;
+        return false;
+    }
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        bool Planned = false;
+        for (ThreadPlan &P : Plan.Threads) Planned |= P.Function == X.first->getName();
+        if (!Planned) {
+            errs () << "ERROR: Yield plan lacks thread: "<< X.first->getName() << endll;
+            return false;
+        }
+    }
+    for (ThreadPlan &P : Plan.Threads) {
+        Function *F = M.getFunction (P.Function);
+        LLVMThread *T = F == nullptr ? nullptr : Threads.lookup (F);
+        if (T == nullptr) {
+            errs () << "ERROR: Yield plan for unknown thread: "<< P.Function << endll;
+            return false;
+        }
+        vector<Instruction *> Is = YieldPlan::instructions (T);
+        if (Is.size() != P.Size) {
+            errs () << "ERROR: Yield plan does not match the code of "<< P.Function << endll;
+            return false;
+        }
+
+        T->BlockStarts.clear ();
+        for (YieldSite &S : P.Sites) {
+            ASSERT (S.Instr < Is.size(), "Yield plan site out of range: "<< S.Instr);
+            Instruction *I = Is[S.Instr];
+            T->BlockStarts[I] = make_pair ((block_e) S.Type, (int) S.Block);
+            LLVMInstr &LI = T->getInstruction(I);
+            LI.Mover = (mover_e) S.Mover;
+            LI.Area = (area_e) S.Area;
+            LI.Atomic = S.Flags & SITE_ATOMIC;
+            if (LI.SCC != nullptr) LI.SCC->setLeftMovers (S.Flags & SITE_LEFT_SCC);
+        }
+        for (uint32_t i = 0; i < P.Marks.size(); i++) {
+            InstrMark &K = P.Marks[i];
+            if (K.Area == Unknown && K.Mover == UnknownMover && K.Notes == 0) continue;
+            LLVMInstr &LI = T->getInstruction(Is[i]);
+            LI.Area = (area_e) K.Area;
+            LI.Mover = (mover_e) K.Mover;
+            LI.Notes = K.Notes;
+            if (!opts.dryRun) annotate (Is[i], LI.Notes);
+        }
+    }
+    return true;
+}
+
+/**
+ * The compares in a pointer or lock check (see addFixedCAS, addStaticPtr).
+ */
+static unsigned
+checkCompares (Value *Check)
+{
+    if (isa<CmpInst>(Check)) return 1;
+    BinaryOperator *Op = dyn_cast<BinaryOperator>(Check);
+    if (Op == nullptr) return 0;
+    return checkCompares (Op->getOperand(0)) + checkCompares (Op->getOperand(1));
+}
+
+/**
+ * Cost model for a dynamic yield site: prefers a static yield over the
+ * checks when they are too large (the blocks listed by __act plus the
+ * compares of the pointer and lock checks before it), or when a conflict is
+ * likely anyway. Listed holds, per thread, its listed blocks (refined, see
+ * refineActs) and all its blocks (after coalesceYields). The likelihood is
+ * the chance that some listed thread is in one of its listed blocks,
+ * assuming it resides in each block equally.
+ */
+bool
+LiptonPass::preferStaticYield (SmallVectorImpl<pair<unsigned, unsigned>> &Listed,
+                               unsigned compares, Instruction *I)
+{
+    double Free = 1.0; // no listed thread in a listed block
+    unsigned listed = 0;
+    for (pair<unsigned, unsigned> &L : Listed) {
+        listed += L.first;
+        if (L.second != 0) Free *= 1.0 - (double) L.first / L.second;
+    }
+    int percent = (int) ((1.0 - Free) * 100);
+
+    bool Static = (int) (listed + compares) > opts.checkSize || percent >= opts.actPercent;
+    (Static ? staticSites : dynamicSites)++;
+    if (opts.verbose) {
+        errs () << "NOTICE: "<< (Static ? "static" : "dynamic") <<" yield ("<< listed
+                <<" listed blocks, "<< compares <<" compares, "<< percent <<"% conflict): "
+                << *I << endll;
+    }
+    return Static;
+}
+
 void
 LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block)
 {
@@ -1664,11 +3301,18 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
     LLVMInstr &LI = T->getInstruction(I);
     area_e Area = LI.Area;
     mover_e Mover = LI.Mover;
-    AllocaInst *Phase = T->PhaseVar;
+    if (type == StartBlock) return;
 
-    if (type == StartBlock) {
-        return;
-    } else if (type == LoopBlock) {
+    Function *G = I->getParent()->getParent();
+    bool debug = opts.debug && &T->F == G; // see phaseVar
+
+    // only create the phase variable where the site reads or commits it
+    bool unphased = type != LoopBlock && (LI.Atomic ?
+            Mover == RightMover || (Mover == LeftMover && Area == Post) :
+            Mover == LeftMover && Area == Post && !(type & LoopBlock) && !debug);
+    AllocaInst *Phase = unphased ? nullptr : phaseVar (T, G);
+
+    if (type == LoopBlock) {
         insertLoopYields (LI, I, block, Phase);
         return;
     }
@@ -1691,12 +3335,14 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
             break;
         case NoneMover: {
             // First collect conflicting non-movers from other threads
-            bool staticNM = conflictingNonMovers (sv, nullptr, I, T);
-            LLASSERT (!sv.empty(), "Unexpected ("<< staticNM <<"), no conflicts found for: "<< *I);
+            SmallVector<LLVMInstr *, 8> Is;
+            bool staticNM = LI.isBarrier || conflictingNonMovers (sv, &Is, I, T);
+            LLASSERT (LI.isBarrier || !sv.empty(), "Unexpected ("<< staticNM <<"), no conflicts found for: "<< *I);
 
             Instruction *ThenTerm = I;
             if (!staticNM) {
                 CallInst *DynConflict = CallInst::Create(Act, sv, "", I);
+                ActConflicts[DynConflict] = Is;
                 ThenTerm = SplitBlockAndInsertIfThen (DynConflict, I, false);
                 addMetaData (DynConflict, DYN_YIELD_CONDITION, "");
             }
@@ -1716,7 +3362,7 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
             insertLoopYields (LI, I, block, Phase);
         if (Area != Post)
             new StoreInst(POSTCOMMIT, Phase, I);
-        checkAssert (opts.debug, NextTerm, Phase, Post);
+        checkAssert (debug, NextTerm, Phase, Post);
         break;
     case RightMover:
         if (Area == Top) {
@@ -1724,27 +3370,31 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
             NextTerm = insertDynYield (LI, I, P, type, block, Phase);
         }
         if (Area & Post) {
-            checkAssert (opts.debug, NextTerm, Phase, Post);
+            checkAssert (debug, NextTerm, Phase, Post);
             new StoreInst(PRECOMMIT, Phase, NextTerm);
             insertYield (NextTerm, YieldGlobal, block);
         } else if (type & LoopBlock) {
-            checkAssert (opts.debug, I, Phase, Pre);
+            checkAssert (debug, I, Phase, Pre);
             insertLoopYields (LI, I, block, Phase);
         }
         break;
     case NoneMover: {
         // First collect conflicting non-movers from other threads
         SmallVector<LLVMInstr *, 8> Is;
-        bool staticNM = conflictingNonMovers (sv, &Is, I, T);
-
-        NextTerm = addFixedCAS (LI, type, block, NextTerm, Is, Phase);
+        bool staticNM = LI.isBarrier || conflictingNonMovers (sv, &Is, I, T);
 
-        NextTerm = addStaticPtr (LI, type, block, NextTerm, Is, Phase);
+        SmallVector<Value *, 2> Checks; // dropped with a static yield, see refineActs
+        if (!LI.isBarrier) {
+            NextTerm = addFixedCAS (LI, type, block, NextTerm, Is, Phase, Checks);
+            NextTerm = addStaticPtr (LI, type, block, NextTerm, Is, Phase, Checks);
+        }
 
-        LLASSERT(!sv.empty (),
+        LLASSERT(LI.isBarrier || !sv.empty (),
                  "Unexpected("<< staticNM <<"), no conflicts found for: "<< *I);
         if (!opts.nodyn && !staticNM) { // if in dynamic conflict (non-commutativity)
             CallInst *ActCall = CallInst::Create(Act, sv, "", NextTerm);
+            ActConflicts[ActCall] = Is;
+            ActChecks[ActCall] = Checks;
             NextTerm = insertDynYield (LI, NextTerm, ActCall, type, block, Phase);
             addMetaData (ActCall, DYN_YIELD_CONDITION, "");
         }
@@ -1754,16 +3404,16 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
             Instruction *PhaseTerm = insertDynYield (LI, NextTerm, P, type, block, Phase);
 
             // then branch (post)
-            checkAssert (opts.debug, PhaseTerm, Phase, Post);
+            checkAssert (debug, PhaseTerm, Phase, Post);
             new StoreInst (PRECOMMIT, Phase, PhaseTerm); // Temporarily for yield
             insertYield (PhaseTerm, YieldGlobal, block);
 
             // merge branch (pre, because post was set to pre in then branch)
-            checkAssert (opts.debug, NextTerm, Phase, Pre);
+            checkAssert (debug, NextTerm, Phase, Pre);
             new StoreInst(POSTCOMMIT, Phase, NextTerm);
             break; }
         case Post:
-            checkAssert (opts.debug, NextTerm, Phase, Post);
+            checkAssert (debug, NextTerm, Phase, Post);
 
             new StoreInst (PRECOMMIT, Phase, NextTerm); // Temporarily for yield
             insertYield (NextTerm, YieldGlobal, block);
@@ -1771,7 +3421,7 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
             break;
         case Pre:
         case Bottom:
-            checkAssert (opts.debug, NextTerm, Phase, Pre);
+            checkAssert (debug, NextTerm, Phase, Pre);
 
             new StoreInst(POSTCOMMIT, Phase, NextTerm);
             break;
@@ -1784,21 +3434,121 @@ LiptonPass::dynamicYield (LLVMThread *T, Instruction *I, block_e type, int block
     }
 }
 
-void
-LiptonPass::initialInstrument (Module &M)
+/**
+ * Estimated instrumentation cost of adding a cycle yield at I, following
+ * staticYield / dynamicYield: nothing if I already yields globally.
+ */
+int
+LiptonPass::cutCost (LLVMThread *T, Instruction *I)
 {
-    // Add '__act' and '__yield' functions
-    Type *Int = Type::getInt32Ty (M.getContext ());
-    Type *Bool = Type::getInt1Ty (M.getContext ());
-    Type *Void = FunctionType::getVoidTy (M.getContext ());
-    Constant *C = M.getOrInsertFunction (__YIELD, Void, Int, (Type*)(0));
-    assert (C);
-    YieldGlobal = dyn_cast_or_null<Function> (C);
-    LLASSERT (YieldGlobal, "Cast failed: "<< *C);
+    LLVMInstr &LI = T->getInstruction(I);
+    auto Start = T->BlockStarts.find (I);
+    if (Start != T->BlockStarts.end() && (Start->second.first & YieldBlock) &&
+            (LI.Mover == RightMover || LI.Mover == NoneMover) && (LI.Area & Post)) {
+        return 0;
+    }
+    if (opts.staticAll) {
+        return LI.Area & Post ? opts.costYield : opts.costLocal;
+    } else if (LI.Area == Top && LI.SCC != nullptr && LI.SCC->hasLeftMovers()) {
+        return opts.costCheck + opts.costYield + opts.costLocal + opts.costPhase;
+    } else if (LI.Area == Post) {
+        return opts.costYield + opts.costPhase;
+    }
+    return opts.costLocal;
+}
 
-    Constant *C4 = M.getOrInsertFunction (ASSERT, Int, Bool, (Type*)(0));
-    assert (C4);
-    Assert = dyn_cast_or_null<Function> (C4);
+/**
+ * Relocates the cycle yields of natural loops to the cheapest cut point (see
+ * cutCost) that still cuts all loops the yield serves (see classifyLoops).
+ * The Lipton phase constraints fix the other blocks at their movers.
+ */
+void
+LiptonPass::optimizePlacement ()
+{
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        LLVMThread *T = X.second;
+        vector<pair<Instruction *, SmallVector<BasicBlock *, 2>>> Cuts(T->Cuts.begin(), T->Cuts.end());
+        sort (Cuts.begin(), Cuts.end(),
+              [T] (const pair<Instruction *, SmallVector<BasicBlock *, 2>> &A,
+                   const pair<Instruction *, SmallVector<BasicBlock *, 2>> &B) {
+            return T->BlockStarts.lookup(A.first).second < T->BlockStarts.lookup(B.first).second;
+        });
+        for (pair<Instruction *, SmallVector<BasicBlock *, 2>> &Cut : Cuts) {
+            Instruction *From = Cut.first;
+            if (T->Cuts.count (From) == 0) continue;
+            Cut.second = T->Cuts[From]; // may have been merged into
+
+            // candidate blocks cut every loop served by From
+            DenseSet<BasicBlock *> Blocks;
+            bool first = true;
+            for (BasicBlock *H : Cut.second) {
+                auto It = LoopCuts.find (H);
+                if (It == LoopCuts.end()) { Blocks.clear(); break; } // irreducible
+                DenseSet<BasicBlock *> Next;
+                for (BasicBlock *C : It->second) {
+                    if (first || Blocks.count (C)) Next.insert (C);
+                }
+                Blocks = Next;
+                first = false;
+            }
+
+            Instruction *Best = From;
+            int BestCost = cutCost (T, From);
+            for (BasicBlock *C : Blocks) {
+                for (Instruction &I : *C) {
+                    if (isa<PHINode>(&I) || I.isTerminator()) continue;
+                    LLVMInstr &LI = T->getInstruction(&I);
+                    if (LI.Atomic || LI.singleThreaded()) continue;
+                    int Cost = cutCost (T, &I);
+                    if (Cost < BestCost) {
+                        Best = &I;
+                        BestCost = Cost;
+                    }
+                }
+            }
+            if (Best == From) continue;
+
+            if (opts.verbose) errs () << "Moving cycle yield: "<< *From << " --> "<< *Best << endll;
+            pair<block_e, int> &Old = T->BlockStarts[From];
+            int block = Old.second;
+            if (Old.first == LoopBlock) {
+                T->BlockStarts.erase (From);
+            } else {
+                Old.first = (block_e) ((int)Old.first & ~(int)LoopBlock);
+                block = 0;
+                for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts)
+                    block = std::max (block, Y.second.second + 1);
+            }
+            auto Existing = T->BlockStarts.find (Best);
+            if (Existing != T->BlockStarts.end()) {
+                Existing->second.first = (block_e) ((int)Existing->second.first | (int)LoopBlock);
+            } else {
+                T->BlockStarts[Best] = make_pair (LoopBlock, block);
+            }
+            T->getInstruction(From).FVS = false;
+            T->getInstruction(Best).FVS = true;
+            SmallVector<BasicBlock *, 2> &Served = T->Cuts[Best];
+            Served.append (Cut.second.begin(), Cut.second.end());
+            T->Cuts.erase (From);
+        }
+    }
+}
+
+void
+LiptonPass::initialInstrument (Module &M)
+{
+    // Add '__act' and '__yield' functions
+    Type *Int = Type::getInt32Ty (M.getContext ());
+    Type *Bool = Type::getInt1Ty (M.getContext ());
+    Type *Void = FunctionType::getVoidTy (M.getContext ());
+    Constant *C = M.getOrInsertFunction (__YIELD, Void, Int, (Type*)(0));
+    assert (C);
+    YieldGlobal = dyn_cast_or_null<Function> (C);
+    LLASSERT (YieldGlobal, "Cast failed: "<< *C);
+
+    Constant *C4 = M.getOrInsertFunction (ASSERT, Int, Bool, (Type*)(0));
+    assert (C4);
+    Assert = dyn_cast_or_null<Function> (C4);
     LLASSERT (Assert, "Cast failed: "<< *C4);
 
     Constant *C3 = M.getOrInsertFunction (__YIELD_LOCAL, Void, Int, (Type*)(0));
@@ -1844,6 +3594,42 @@ LiptonPass::staticYield (LLVMThread *T, Instruction *I, block_e type, int block)
     }
 }
 
+/**
+ * The phase variable of T in G, created on first use. Callees of the thread
+ * get their own, which conservatively starts post commit (the phase at the
+ * call is unknown there); finalInstrument makes callers continue post commit
+ * after calls that may commit. The debug phase assertions are only checked
+ * in the thread function itself.
+ */
+AllocaInst *
+LiptonPass::phaseVar (LLVMThread *T, Function *G)
+{
+    AllocaInst *&Phase = T->Phases[G];
+    if (Phase == nullptr) {
+        Instruction *Start = G->getEntryBlock().getFirstNonPHI();
+        Phase = new AllocaInst (Type::getInt1Ty (G->getContext()), "__phase", Start);
+        new StoreInst (POSTCOMMIT, Phase, Start);
+    }
+    return Phase;
+}
+
+/**
+ * The functions of all threads (see LLVMThread::functions), each with the
+ * first thread that reaches it.
+ */
+vector<pair<LLVMThread *, Function *>>
+LiptonPass::threadFunctions ()
+{
+    vector<pair<LLVMThread *, Function *>> Fs;
+    DenseSet<Function *> Seen;
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        for (Function *G : X.second->functions()) {
+            if (Seen.insert (G).second) Fs.push_back (make_pair (X.second, G));
+        }
+    }
+    return Fs;
+}
+
 void
 LiptonPass::finalInstrument (Module &M)
 {
@@ -1857,7 +3643,7 @@ LiptonPass::finalInstrument (Module &M)
         for (pair<Function *, LLVMThread *> X : Threads) {
             LLVMThread *T = X.second;
 
-            for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts) {
+            for (pair<Instruction *, pair<block_e, int>> Y : T->orderedStarts()) {
                 int block = Y.second.second;
                 Instruction *I = Y.first;
                 block_e type = Y.second.first;
@@ -1872,21 +3658,925 @@ LiptonPass::finalInstrument (Module &M)
             Instruction *Start = T->getEntryBlock().getFirstNonPHI();
             AllocaInst *Phase = new AllocaInst (Bool, "__phase", Start);
             new StoreInst (PRECOMMIT, Phase, Start);
-            X.second->PhaseVar = Phase;
+            X.second->Phases[T] = Phase;
         }
 
         // instrument code with dynamic yields
         for (pair<Function *, LLVMThread *> X : Threads) {
             LLVMThread *T = X.second;
 
-            for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts) {
+            for (pair<Instruction *, pair<block_e, int>> Y : T->orderedStarts()) {
                 int block = Y.second.second;
                 Instruction *I = Y.first;
                 block_e type = Y.second.first;
                 dynamicYield (T, I, type, block);
             }
         }
+
+        // callees with non-mover or left-mover blocks may commit: the caller
+        // continues post commit
+        for (pair<Function *, LLVMThread *> X : Threads) {
+            LLVMThread *T = X.second;
+            DenseSet<Function *> Committing;
+            for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts) {
+                LLVMInstr *LI = T->Instructions.lookup (Y.first);
+                if (Y.second.first == StartBlock || LI == nullptr) continue;
+                if (LI->Mover == NoneMover || LI->Mover == LeftMover) {
+                    Committing.insert (Y.first->getParent()->getParent());
+                }
+            }
+            for (Function *G : T->functions()) {
+                AllocaInst *Phase = T->Phases.lookup (G);
+                if (Phase == nullptr) continue;
+                for (inst_iterator It = inst_begin(G), E = inst_end(G); It != E; ++It) {
+                    Function *Callee = walkedCallee (&*It);
+                    if (Callee == nullptr) continue;
+                    bool commits = false;
+                    for (Function *H : reachedFunctions (*Callee)) commits |= Committing.count (H) != 0;
+                    if (commits) new StoreInst (POSTCOMMIT, Phase, It->getNextNode());
+                }
+            }
+        }
+    }
+}
+
+static bool
+isYieldCall (Instruction *I)
+{
+    CallInst *Call = dyn_cast<CallInst>(I);
+    return Call != nullptr && (Call->getCalledFunction() == YieldGlobal ||
+                               Call->getCalledFunction() == YieldLocal);
+}
+
+static int
+yieldBlock (Instruction *Yield)
+{
+    return cast<ConstantInt>(cast<CallInst>(Yield)->getArgOperand(0))->getSExtValue();
+}
+
+/**
+ * I does not touch shared memory in a way that needs a yield: both-movers,
+ * thread-local accesses and the instrumentation (phase variable, checks).
+ */
+static bool
+yieldNeutral (LLVMThread *T, Instruction *I)
+{
+    if (isa<TerminatorInst>(I) || isa<DbgInfoIntrinsic>(I)) return true;
+    if (CallInst *Call = dyn_cast<CallInst>(I)) {
+        Function *F = Call->getCalledFunction();
+        if (F == Act || F == Assert) return true;
+    }
+    if (!I->mayReadOrWriteMemory()) return true;
+    LLVMInstr *LI = T->Instructions.lookup (I);
+    if (LI != nullptr) return LI->Mover == BothMover || LI->singleThreaded();
+    if (LoadInst *Load = dyn_cast<LoadInst>(I))
+        return isa<AllocaInst>(Load->getPointerOperand());
+    if (StoreInst *Store = dyn_cast<StoreInst>(I))
+        return isa<AllocaInst>(Store->getPointerOperand());
+    return false;
+}
+
+/**
+ * The yield that every path to Y passes last, if only neutral instructions
+ * lie in between (see yieldNeutral). Follows single predecessors only.
+ * Always tells whether Y also follows on every path from the yield, i.e. no
+ * branch leaves the way between them.
+ */
+static Instruction *
+previousYield (LLVMThread *T, Instruction *Y, DenseSet<Instruction *> &Dead, bool &Always)
+{
+    BasicBlock *B = Y->getParent();
+    Instruction *X = Y;
+    SmallPtrSet<BasicBlock *, 8> Seen;
+    Seen.insert (B);
+    Always = true;
+    while (true) {
+        if (X == &B->front()) {
+            B = B->getSinglePredecessor ();
+            if (B == nullptr || !Seen.insert (B).second) return nullptr;
+            X = B->getTerminator();
+            Always &= X->getNumSuccessors() == 1;
+        } else {
+            X = X->getPrevNode();
+        }
+        if (isYieldCall (X)) {
+            if (Dead.count (X) == 0) return X;
+        } else if (!yieldNeutral (T, X)) {
+            return nullptr;
+        }
+    }
+}
+
+/**
+ * Removes yields that follow another yield with only neutral instructions in
+ * between: a yield after a global yield, or a local yield that is always
+ * followed by a global one. Block numbers are then renumbered densely per thread,
+ * including the block arguments of __act (removed blocks map to the block
+ * of the surviving yield). This covers the callees of the thread; threads
+ * that share a callee with another thread keep their yields there and their
+ * block numbers.
+ */
+void
+LiptonPass::coalesceYields (Module &M)
+{
+    // functions reached by several threads keep their yields and block ids
+    DenseMap<Function *, int> Owners;
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        for (Function *G : X.second->functions()) Owners[G]++;
+    }
+
+    DenseMap<LLVMThread *, DenseMap<int, int>> Renumber;
+    int removed = 0;
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        LLVMThread *T = X.second;
+        vector<Instruction *> Yields;
+        bool shared = false;
+        for (Function *G : T->functions()) {
+            shared |= Owners[G] > 1;
+            for (inst_iterator I = inst_begin(G), E = inst_end(G); I != E; ++I) {
+                if (isYieldCall (&*I)) Yields.push_back (&*I);
+            }
+        }
+
+        DenseSet<Instruction *> Dead;
+        DenseMap<int, int> Merged; // removed block -> surviving block
+        for (Instruction *Y : Yields) {
+            if (Dead.count (Y) || Owners[Y->getParent()->getParent()] > 1) continue;
+            bool Always;
+            Instruction *P = previousYield (T, Y, Dead, Always);
+            if (P == nullptr) continue;
+            bool PGlobal = cast<CallInst>(P)->getCalledFunction() == YieldGlobal;
+            bool YGlobal = cast<CallInst>(Y)->getCalledFunction() == YieldGlobal;
+            // P may only go if Y replaces it on every path (e.g. not when Y
+            // is guarded by a dynamic check and P cuts a cycle)
+            if (!PGlobal && YGlobal && !Always) continue;
+            Instruction *Gone = PGlobal || !YGlobal ? Y : P;
+            Instruction *Kept = Gone == Y ? P : Y;
+            if (opts.verbose) errs () << "Coalescing yield: "<< *Gone << endll;
+            Dead.insert (Gone);
+            if (yieldBlock (Gone) != yieldBlock (Kept))
+                Merged[yieldBlock (Gone)] = yieldBlock (Kept);
+        }
+
+        // blocks still in use keep their (relative) order
+        std::set<int> Live;
+        for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts)
+            Live.insert (Y.second.second);
+        for (Instruction *Y : Yields) {
+            if (Dead.count (Y) == 0) Live.insert (yieldBlock (Y));
+        }
+        for (Instruction *Y : Yields) {
+            if (Dead.count (Y) == 0) continue;
+            int block = yieldBlock (Y);
+            bool used = false;
+            for (Instruction *Z : Yields) {
+                used |= Dead.count (Z) == 0 && yieldBlock (Z) == block;
+            }
+            if (!used) Live.erase (block);
+        }
+        DenseMap<int, int> &Map = Renumber[T];
+        int next = 0;
+        for (int block : Live) Map[block] = shared ? block : next++;
+        for (pair<int, int> Y : Merged) {
+            int block = Y.first;
+            for (unsigned i = 0; i <= Merged.size() && Live.count (block) == 0 &&
+                                 Merged.count (block); i++) {
+                block = Merged[block];
+            }
+            if (Live.count (Y.first) == 0 && Map.count (block))
+                Map[Y.first] = Map[block];
+        }
+
+        for (Instruction *Y : Dead) Y->eraseFromParent ();
+        removed += Dead.size();
+    }
+
+    // rewrite block arguments of yields and __act
+    DenseSet<Function *> Done;
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        LLVMThread *T = X.second;
+        DenseMap<int, int> &Map = Renumber[T];
+        for (Function *G : T->functions()) {
+            if (!Done.insert (G).second) continue;
+            for (inst_iterator It = inst_begin(G), E = inst_end(G); It != E; ++It) {
+                Instruction &I = *It;
+                if (isYieldCall (&I)) {
+                    CallInst *Call = cast<CallInst>(&I);
+                    Type *Ty = Call->getArgOperand(0)->getType();
+                    if (Map.count (yieldBlock (Call)))
+                        Call->setArgOperand (0, ConstantInt::get (Ty, Map[yieldBlock (Call)]));
+                    continue;
+                }
+                CallInst *Call = dyn_cast<CallInst>(&I);
+                if (Call == nullptr || Call->getCalledFunction() != Act) continue;
+                LLVMThread *Other = nullptr;
+                for (unsigned i = 0; i < Call->getNumArgOperands(); i++) {
+                    Value *V = Call->getArgOperand(i);
+                    if (Function *F = dyn_cast<Function>(V)) {
+                        Other = Threads.lookup (F);
+                    } else if (ConstantInt *C = dyn_cast<ConstantInt>(V)) {
+                        if (Other == nullptr || Renumber[Other].count (C->getSExtValue()) == 0) continue;
+                        int block = Renumber[Other][C->getSExtValue()];
+                        Call->setArgOperand (i, ConstantInt::get (C->getType(), block));
+                    }
+                }
+            }
+        }
+        for (auto &Y : T->BlockStarts) {
+            if (Map.count (Y.second.second)) Y.second.second = Map[Y.second.second];
+        }
+    }
+
+    errs () << "Coalesced "<< removed <<" redundant yields" << endll;
+}
+
+/**
+ * Constant block mask: word 0 holds the number of words that follow, bit b
+ * of the words is set iff block b is in Blocks. Identical masks are shared.
+ */
+Constant *
+LiptonPass::blockMask (Module &M, const std::set<int> &Blocks)
+{
+    vector<uint64_t> Words(1 + (Blocks.empty() ? 0 : *Blocks.rbegin() / 64 + 1), 0);
+    Words[0] = Words.size() - 1;
+    for (int b : Blocks) Words[1 + b / 64] |= 1ull << (b % 64);
+
+    GlobalVariable *&GV = Masks[Words];
+    if (GV == nullptr) {
+        vector<Constant *> Elems;
+        for (uint64_t W : Words) Elems.push_back (ConstantInt::get (Int64, W));
+        ArrayType *Ty = ArrayType::get (Int64, Words.size());
+        GV = new GlobalVariable (M, Ty, true, GlobalValue::PrivateLinkage,
+                                 ConstantArray::get (Ty, Elems), "__act_mask");
+        GV->setUnnamedAddr (true);
+    }
+    return GV;
+}
+
+/**
+ * J may execute while the thread is in the block that starts at From (the
+ * thread entry or a yield): J is reachable without passing another yield.
+ * Calls lead into the walked callees, returns to every call site in the
+ * functions Reached by the thread.
+ */
+static bool
+beforeNextYield (Instruction *From, Instruction *J, SmallPtrSetImpl<Function *> &Reached)
+{
+    SmallVector<Instruction *, 8> Work;
+    SmallPtrSet<Instruction *, 16> Seen;
+    Work.push_back (isYieldCall (From) ? From->getNextNode() : From);
+    while (!Work.empty()) {
+        Instruction *Start = Work.pop_back_val ();
+        BasicBlock *B = Start->getParent();
+        bool left = false;
+        for (BasicBlock::iterator It(Start); It != B->end(); ++It) {
+            if (&*It == J) return true;
+            if (isYieldCall (&*It)) {
+                left = true;
+                break;
+            }
+            if (Function *Callee = walkedCallee (&*It)) {
+                // continues after the call through the returns of the callee
+                Instruction *Entry = &Callee->getEntryBlock().front();
+                if (Seen.insert (Entry).second) Work.push_back (Entry);
+                left = true;
+                break;
+            }
+        }
+        if (left) continue;
+        TerminatorInst *Term = B->getTerminator();
+        if (isa<ReturnInst>(Term)) {
+            Function *G = B->getParent();
+            for (User *U : G->users()) {
+                CallInst *Call = dyn_cast<CallInst>(U);
+                if (Call == nullptr || Call->getCalledFunction() != G ||
+                        Reached.count (Call->getParent()->getParent()) == 0) {
+                    continue;
+                }
+                Instruction *Next = Call->getNextNode();
+                if (Seen.insert (Next).second) Work.push_back (Next);
+            }
+        }
+        for (unsigned i = 0; i < Term->getNumSuccessors(); i++) {
+            Instruction *S = &Term->getSuccessor(i)->front();
+            if (Seen.insert (S).second) Work.push_back (S);
+        }
     }
+    return false;
+}
+
+/**
+ * Refines the __act arguments to exit points: a block of another thread is
+ * listed only if a conflicting instruction can execute in it before the
+ * thread's next yield. The blocks of each thread are passed as a constant
+ * bitmask (see blockMask): '__act(t_1, mask_1, t_2, mask_2, ...)'. Checks
+ * without any remaining block are false, those the cost model rejects (see
+ * preferStaticYield) are true, i.e. yield statically, and so are the pointer
+ * and lock checks of their site.
+ */
+void
+LiptonPass::refineActs (Module &M)
+{
+    int refined = 0;
+    for (pair<Instruction *, SmallVector<LLVMInstr *, 8>> X : ActConflicts) {
+        CallInst *Call = cast<CallInst>(X.first);
+        SmallVector<Value *, 8> Args;
+        SmallVector<pair<unsigned, unsigned>, 4> Listed; // see preferStaticYield
+        for (pair<Function *, LLVMThread *> Y : Threads) {
+            LLVMThread *T2 = Y.second;
+            std::set<int> Blocks;
+
+            vector<Function *> Fs = T2->functions ();
+            SmallPtrSet<Function *, 8> Reached(Fs.begin(), Fs.end());
+
+            // the block regions of T2: thread entry and the yields of every
+            // function it reaches
+            vector<pair<Instruction *, int>> Regions;
+            for (pair<Instruction *, pair<block_e, int>> Z : T2->BlockStarts) {
+                if (Z.second.first == StartBlock)
+                    Regions.push_back (make_pair (&*T2->F.getEntryBlock().begin(), Z.second.second));
+            }
+            for (Function *G : Fs) {
+                for (inst_iterator I = inst_begin(G), E = inst_end(G); I != E; ++I) {
+                    if (isYieldCall (&*I)) Regions.push_back (make_pair (&*I, yieldBlock (&*I)));
+                }
+            }
+
+            for (LLVMInstr *LJ : X.second) {
+                if (Reached.count (LJ->I->getParent()->getParent()) == 0) continue;
+                for (pair<Instruction *, int> &R : Regions) {
+                    if (Blocks.count (R.second) == 0 && beforeNextYield (R.first, LJ->I, Reached))
+                        Blocks.insert (R.second);
+                }
+            }
+            if (Blocks.empty()) continue;
+            Args.push_back (&T2->F);
+            Args.push_back (blockMask (M, Blocks));
+
+            std::set<int> All;
+            for (pair<Instruction *, int> &R : Regions) All.insert (R.second);
+            Listed.push_back (make_pair (Blocks.size(), All.size()));
+        }
+
+        SmallVector<Value *, 2> &Checks = ActChecks[Call];
+        unsigned compares = 0;
+        for (Value *Check : Checks) compares += checkCompares (Check);
+
+        if (Args.empty()) {
+            Call->replaceAllUsesWith (FALSE);
+        } else if (preferStaticYield (Listed, compares, Call)) {
+            Call->replaceAllUsesWith (TRUE);
+            for (Value *Check : Checks) {
+                Check->replaceAllUsesWith (TRUE);
+                RecursivelyDeleteTriviallyDeadInstructions (Check);
+            }
+        } else {
+            CallInst *New = CallInst::Create (Act, Args, "", Call);
+            addMetaData (New, DYN_YIELD_CONDITION, "");
+            Call->replaceAllUsesWith (New);
+        }
+        Call->eraseFromParent ();
+        refined++;
+    }
+    ActConflicts.clear ();
+    ActChecks.clear ();
+    errs () << "Refined "<< refined <<" __act checks to "<< Masks.size() <<" block masks" << endll;
+    errs () << "Yield sites: "<< dynamicSites <<" dynamic, "<< staticSites
+            <<" static by cost (-t "<< opts.checkSize <<","<< opts.actPercent <<")" << endll;
+}
+
+/**
+ * The instructions of G keyed in the Instructions, BlockStarts and PhasePhis
+ * of any thread (callees may be shared), watched across CFG simplifications
+ * (ConstantFoldTerminator, removeUnreachableBlocks) that may delete them,
+ * e.g. phis of a removed predecessor or unreachable blocks. A handle that no
+ * longer holds its instruction (deleted, or replaced before its deletion)
+ * marks a key to forget.
+ */
+struct KeyWatch {
+    ThreadMap                              &Threads;
+    vector<pair<Instruction *, WeakVH>>     Keys;
+
+    KeyWatch (ThreadMap &Threads, Function &G) : Threads(Threads)
+    {
+        SmallPtrSet<Instruction *, 64> Seen;
+        for (pair<Function *, LLVMThread *> &X : Threads) {
+            LLVMThread *T = X.second;
+            for (pair<Instruction *, LLVMInstr *> Y : T->Instructions) watch (Y.first, G, Seen);
+            for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts) watch (Y.first, G, Seen);
+            for (PHINode *PN : T->PhasePhis) watch (PN, G, Seen);
+        }
+    }
+
+    void
+    watch (Instruction *I, Function &G, SmallPtrSetImpl<Instruction *> &Seen)
+    {
+        if (I->getParent()->getParent() == &G && Seen.insert (I).second)
+            Keys.push_back (make_pair (I, WeakVH(I)));
+    }
+
+    void
+    forget ()
+    {
+        for (pair<Instruction *, WeakVH> &K : Keys) {
+            if ((Value *) K.second == K.first) continue;
+            for (pair<Function *, LLVMThread *> &X : Threads) {
+                LLVMThread *T = X.second;
+                T->Instructions.erase (K.first);
+                T->BlockStarts.erase (K.first);
+                T->PhasePhis.erase (static_cast<PHINode *>(K.first));
+            }
+        }
+        Keys.clear ();
+    }
+};
+
+/**
+ * Builds the phase variables in SSA form: promotes each __phase alloca to
+ * phis, then folds the phase checks that became constant (the Area lattice
+ * fixes the phase outside Top) and removes the yield branches they guarded.
+ * Threads without Top areas are left without any phase value. Callees of a
+ * thread have their own phase variables (see phaseVar).
+ */
+void
+LiptonPass::promotePhases ()
+{
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        LLVMThread *T = X.second;
+        for (Function *G : T->functions()) {
+            AllocaInst *Phase = T->Phases.lookup (G);
+            if (Phase == nullptr) continue;
+            LLASSERT (isAllocaPromotable (Phase), "Phase variable escapes: "<< *Phase);
+
+            // the checks reading the phase
+            vector<Instruction *> Work;
+            for (User *U : Phase->users()) {
+                if (LoadInst *Load = dyn_cast<LoadInst>(U)) {
+                    for (User *V : Load->users()) Work.push_back (cast<Instruction>(V));
+                }
+            }
+
+            DenseSet<PHINode *> Old;
+            for (BasicBlock &B : *G) {
+                for (Instruction &I : B) {
+                    if (!isa<PHINode>(&I)) break;
+                    Old.insert (cast<PHINode>(&I));
+                }
+            }
+            DominatorTree DT;
+            DT.recalculate (*G);
+            PromoteMemToReg (Phase, DT);
+            for (BasicBlock &B : *G) {
+                for (Instruction &I : B) {
+                    if (!isa<PHINode>(&I)) break;
+                    if (Old.count (cast<PHINode>(&I))) continue;
+                    T->PhasePhis.insert (cast<PHINode>(&I)); // new: phase values only
+                    Work.push_back (&I);
+                }
+            }
+
+            DenseSet<BasicBlock *> Branches;
+            DenseSet<Instruction *> Seen;
+            while (!Work.empty()) {
+                Instruction *I = Work.back ();
+                Work.pop_back ();
+                if (!Seen.insert (I).second) continue;
+                if (TerminatorInst *Term = dyn_cast<TerminatorInst>(I)) {
+                    Branches.insert (Term->getParent());
+                    continue;
+                }
+                Value *V = SimplifyInstruction (I);
+                if (V == nullptr) continue;
+                for (User *U : I->users()) {
+                    Seen.erase (cast<Instruction>(U));
+                    Work.push_back (cast<Instruction>(U));
+                }
+                I->replaceAllUsesWith (V);
+                if (isInstructionTriviallyDead (I)) {
+                    Seen.insert (I); // stale entries in Work
+                    for (pair<Function *, LLVMThread *> Y : Threads) {
+                        Y.second->Instructions.erase (I);
+                        Y.second->BlockStarts.erase (I);
+                        if (PHINode *PN = dyn_cast<PHINode>(I)) Y.second->PhasePhis.erase (PN);
+                    }
+                    I->eraseFromParent ();
+                }
+            }
+
+            KeyWatch Watch(Threads, *G);
+            bool folded = false;
+            for (BasicBlock *B : Branches) {
+                folded |= ConstantFoldTerminator (B, true);
+            }
+            if (folded) removeUnreachableBlocks (*G);
+            Watch.forget ();
+        }
+        T->Phases.clear ();
+    }
+}
+
+/**
+ * A phase phi of B (see promotePhases) that merges a known phase from some
+ * predecessor: B is reached both pre and post commit (Top).
+ */
+static PHINode *
+phasePhi (LLVMThread *T, BasicBlock *B)
+{
+    for (Instruction &I : *B) {
+        PHINode *PN = dyn_cast<PHINode>(&I);
+        if (PN == nullptr) break;
+        if (T->PhasePhis.count (PN) == 0) continue;
+        if (PN->hasConstantValue() != nullptr) continue;
+        for (unsigned i = 0; i < PN->getNumIncomingValues(); i++) {
+            if (isa<ConstantInt>(PN->getIncomingValue(i))) return PN;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Phase-context specialization: a block reached under a known phase from a
+ * predecessor is cloned for that predecessor, so that the phase is constant
+ * in the copy. Repeating this along the Top region duplicates it into pre
+ * and post commit copies until the phase checks fold. This covers every
+ * function of a thread. Loop headers are not cloned and the code growth per
+ * thread is bounded by opts.cloneBudget. Callees are not cloned per calling
+ * phase: their phase starts post commit (see phaseVar), so the checks that
+ * only depend on the phase at entry fold, at the price of the yields a pre
+ * commit copy would avoid.
+ */
+void
+LiptonPass::specializePhases ()
+{
+    int cloned = 0;
+    for (pair<Function *, LLVMThread *> X : Threads) {
+        LLVMThread *T = X.second;
+        int budget = opts.cloneBudget;
+        for (Function *G : T->functions()) {
+            Function &F = *G;
+
+            bool changed = true;
+            while (changed && budget > 0) {
+                changed = false;
+                DominatorTree DT;
+                DT.recalculate (F);
+                for (BasicBlock &M : F) {
+                    PHINode *P = phasePhi (T, &M);
+                    if (P == nullptr || &M == &F.getEntryBlock()) continue;
+                    int size = std::distance (BasicBlock::iterator(M.getFirstNonPHI()), M.end());
+                    if (size > budget) continue;
+                    bool header = false;
+                    for (pred_iterator Pi = pred_begin(&M); Pi != pred_end(&M); ++Pi)
+                        header |= DT.dominates (&M, *Pi);
+                    if (header) continue;
+
+                    // predecessors with a known phase, and a single edge to M
+                    SmallVector<BasicBlock *, 4> Preds;
+                    for (unsigned i = 0; i < P->getNumIncomingValues(); i++) {
+                        BasicBlock *Pred = P->getIncomingBlock(i);
+                        if (!isa<ConstantInt>(P->getIncomingValue(i))) continue;
+                        if (std::count (pred_begin(&M), pred_end(&M), Pred) != 1) continue;
+                        Preds.push_back (Pred);
+                    }
+                    if (Preds.empty() || (int) Preds.size() == std::distance (pred_begin(&M), pred_end(&M)))
+                        Preds.pop_back (); // M keeps one context
+                    if (Preds.empty()) continue;
+
+                    // uses of M's values outside M, rewritten after cloning
+                    vector<Use *> Outside;
+                    for (Instruction &I : M) {
+                        for (Use &U : I.uses()) {
+                            Instruction *User = cast<Instruction>(U.getUser());
+                            if (User->getParent() != &M || isa<PHINode>(User)) Outside.push_back (&U);
+                        }
+                    }
+
+                    vector<pair<BasicBlock *, ValueToValueMapTy *>> Clones;
+                    for (BasicBlock *Pred : Preds) {
+                        ValueToValueMapTy *VMap = new ValueToValueMapTy;
+                        BasicBlock *C = CloneBasicBlock (&M, *VMap, P->getIncomingValueForBlock(Pred) == TRUE ?
+                                                         ".post" : ".pre", &F);
+                        for (Instruction &I : M) {
+                            PHINode *PN = dyn_cast<PHINode>(&I);
+                            if (PN == nullptr) break;
+                            Instruction *Copy = cast<Instruction>((*VMap)[PN]);
+                            (*VMap)[PN] = PN->getIncomingValueForBlock (Pred);
+                            Copy->replaceAllUsesWith ((*VMap)[PN]);
+                            Copy->eraseFromParent ();
+                        }
+                        for (Instruction &I : *C) {
+                            RemapInstruction (&I, *VMap, RF_IgnoreMissingEntries);
+                        }
+                        Pred->getTerminator()->replaceUsesOfWith (&M, C);
+                        for (Instruction &I : M) {
+                            PHINode *PN = dyn_cast<PHINode>(&I);
+                            if (PN == nullptr) break;
+                            PN->removeIncomingValue (Pred, false);
+                        }
+                        TerminatorInst *Term = C->getTerminator();
+                        for (unsigned i = 0; i < Term->getNumSuccessors(); i++) {
+                            for (Instruction &I : *Term->getSuccessor(i)) {
+                                PHINode *PN = dyn_cast<PHINode>(&I);
+                                if (PN == nullptr) break;
+                                if (PN->getBasicBlockIndex (C) != -1) continue; // repeated edge
+                                Value *V = PN->getIncomingValueForBlock (&M);
+                                Value *Mapped = VMap->lookup (V);
+                                PN->addIncoming (Mapped ? Mapped : V, C);
+                            }
+                        }
+                        KeyWatch Watch(Threads, F);
+                        ConstantFoldTerminator (C, true);
+                        Watch.forget ();
+                        Clones.push_back (make_pair (C, VMap));
+                        budget -= size;
+                        cloned++;
+                    }
+
+                    // values of M now also defined in the clones
+                    for (Use *U : Outside) {
+                        Instruction *Def = cast<Instruction>(U->get());
+                        SmallVector<PHINode *, 4> Inserted;
+                        SSAUpdater SSA(&Inserted);
+                        SSA.Initialize (Def->getType(), Def->getName());
+                        SSA.AddAvailableValue (&M, Def);
+                        for (pair<BasicBlock *, ValueToValueMapTy *> &C : Clones) {
+                            SSA.AddAvailableValue (C.first, C.second->lookup (Def));
+                        }
+                        SSA.RewriteUse (*U);
+                        // merges of the phase are phase phis as well
+                        if (isa<PHINode>(Def) && T->PhasePhis.count (cast<PHINode>(Def))) {
+                            for (PHINode *PN : Inserted) T->PhasePhis.insert (PN);
+                        }
+                    }
+                    for (pair<BasicBlock *, ValueToValueMapTy *> &C : Clones) delete C.second;
+                    changed = true;
+                    break; // CFG changed
+                }
+            }
+
+            KeyWatch Watch(Threads, F);
+            for (BasicBlock &B : F) ConstantFoldTerminator (&B, true);
+            removeUnreachableBlocks (F);
+            Watch.forget ();
+        }
+        T->PhasePhis.clear ();
+    }
+    errs () << "Specialized "<< cloned <<" blocks to a known phase" << endll;
+}
+
+/**
+ * Dynamic yield conditions, in each function of a thread: hoists the
+ * loop-invariant parts built by the instrumentation (pointer and lock
+ * compares) to the loop preheaders, and reuses an __act result for an
+ * identical __act call that follows it without a yield, or a call that may
+ * reach one, in between (other threads only move at yields).
+ */
+void
+LiptonPass::hoistYieldConditions ()
+{
+    int hoisted = 0, reused = 0;
+    for (pair<LLVMThread *, Function *> X : threadFunctions()) {
+        LLVMThread *T = X.first;
+        Function &F = *X.second;
+
+        DominatorTree DT;
+        DT.recalculate (F);
+        LoopInfoBase<BasicBlock, Loop> Loops;
+        Loops.Analyze (DT);
+
+        SmallVector<Loop *, 8> Work(Loops.begin(), Loops.end());
+        vector<Loop *> Order; // inner loops first
+        while (!Work.empty()) {
+            Loop *L = Work.pop_back_val ();
+            Order.insert (Order.begin(), L);
+            Work.append (L->begin(), L->end());
+        }
+        for (Loop *L : Order) {
+            BasicBlock *Preheader = L->getLoopPreheader();
+            if (Preheader == nullptr) continue;
+            for (BasicBlock *B : L->getBlocks()) {
+                for (BasicBlock::iterator It = B->begin(); It != B->end(); ) {
+                    Instruction *I = It++;
+                    if (T->Instructions.count (I)) continue; // program code
+                    if (!isa<CmpInst>(I) && !isa<BinaryOperator>(I) &&
+                            !isa<CastInst>(I) && !isa<GetElementPtrInst>(I)) {
+                        continue;
+                    }
+                    // only instrumentation: its operand chain may hold program code
+                    if (!L->hasLoopInvariantOperands (I)) continue;
+                    bool Changed = false;
+                    if (L->makeLoopInvariant (I, Changed, Preheader->getTerminator()) && Changed)
+                        hoisted++;
+                }
+            }
+        }
+
+        vector<CallInst *> Acts;
+        for (BasicBlock &B : F) {
+            for (Instruction &I : B) {
+                CallInst *Call = dyn_cast<CallInst>(&I);
+                if (Call && Call->getCalledFunction() == Act) Acts.push_back (Call);
+            }
+        }
+        for (CallInst *Call : Acts) {
+            BasicBlock *B = Call->getParent();
+            Instruction *Prev = Call;
+            SmallPtrSet<BasicBlock *, 8> Seen;
+            Seen.insert (B);
+            while (true) {
+                if (Prev == &B->front()) {
+                    B = B->getSinglePredecessor ();
+                    if (B == nullptr || !Seen.insert (B).second) break;
+                    Prev = B->getTerminator();
+                } else {
+                    Prev = Prev->getPrevNode();
+                }
+                CallInst *Other = dyn_cast<CallInst>(Prev);
+                if (Other == nullptr) continue;
+                Function *Callee = Other->getCalledFunction();
+                if (isYieldCall (Other) || Callee == nullptr || !Callee->isDeclaration())
+                    break; // may reach a yield
+                if (Callee == Act && Other->isIdenticalTo (Call)) {
+                    Call->replaceAllUsesWith (Other);
+                    Call->eraseFromParent ();
+                    reused++;
+                    break;
+                }
+            }
+        }
+    }
+    errs () << "Hoisted "<< hoisted <<" yield conditions, reused "<< reused <<" __act results" << endll;
+}
+
+/**
+ * Routes the per-site yield blocks ({__yield(b); br S} behind a dynamic
+ * check) in each function of a thread through one shared trampoline per
+ * yield function and innermost loop. The trampoline takes the block id and
+ * the return site through phis, yields and switches back. Sharing it only
+ * within a loop keeps the CFG reducible: it is entered from the loop (or its
+ * inner loops) and only continues in the loop, into inner loop headers or to
+ * exits.
+ * Values that are live across a site no longer dominate their uses; they
+ * are demoted and promoted again (phis in the trampoline).
+ */
+void
+LiptonPass::shareYields ()
+{
+    int shared = 0;
+    for (pair<LLVMThread *, Function *> X : threadFunctions()) {
+        LLVMThread *T = X.first;
+        Function &F = *X.second;
+        LLVMContext &Ctx = F.getContext();
+
+        vector<BasicBlock *> Sites;
+        for (BasicBlock &B : F) {
+            if (B.size() != 2 || !isYieldCall (&B.front())) continue;
+            BranchInst *Br = dyn_cast<BranchInst>(B.getTerminator());
+            if (Br == nullptr || Br->isConditional() || B.getSinglePredecessor() == nullptr)
+                continue;
+            Sites.push_back (&B);
+        }
+
+        DominatorTree DT;
+        DT.recalculate (F);
+        LoopInfoBase<BasicBlock, Loop> Loops;
+        Loops.Analyze (DT);
+
+        DenseMap<pair<Function *, Loop *>, BasicBlock *> Tramps;
+        for (BasicBlock *B : Sites) {
+            CallInst *Yield = cast<CallInst>(&B->front());
+            BasicBlock *Pred = B->getSinglePredecessor();
+            BasicBlock *Succ = B->getTerminator()->getSuccessor(0);
+            Function *YieldF = Yield->getCalledFunction();
+            Type *Int = YieldF->getFunctionType()->getParamType(0);
+
+            // one entry per predecessor, constant phi values from the site
+            BasicBlock *&Tramp = Tramps[make_pair (YieldF, Loops.getLoopFor (B))];
+            bool ok = Succ != B;
+            unsigned edges = 0;
+            for (unsigned i = 0; i < Pred->getTerminator()->getNumSuccessors(); i++)
+                edges += Pred->getTerminator()->getSuccessor(i) == B;
+            ok &= edges == 1;
+            if (Tramp != nullptr) {
+                PHINode *Block = cast<PHINode>(&Tramp->front());
+                SwitchInst *Switch = cast<SwitchInst>(Tramp->getTerminator());
+                ok &= Block->getBasicBlockIndex (Pred) == -1;
+                for (unsigned i = 0; i < Switch->getNumSuccessors(); i++)
+                    ok &= Switch->getSuccessor(i) != Succ;
+            }
+            for (Instruction &I : *Succ) {
+                PHINode *PN = dyn_cast<PHINode>(&I);
+                if (PN == nullptr) break;
+                ok &= isa<Constant>(PN->getIncomingValueForBlock (B));
+            }
+            if (!ok) continue;
+
+            bool first = Tramp == nullptr;
+            if (first) {
+                Tramp = BasicBlock::Create (Ctx, YieldF->getName() + ".tramp", &F);
+                PHINode *Block = PHINode::Create (Int, 0, "block", Tramp);
+                PHINode *Site = PHINode::Create (Int, 0, "site", Tramp);
+                CallInst::Create (YieldF, Block, "", Tramp);
+                SwitchInst::Create (Site, Succ, 0, Tramp);
+            }
+            PHINode *Block = cast<PHINode>(&Tramp->front());
+            PHINode *Site = cast<PHINode>(Block->getNextNode());
+            SwitchInst *Switch = cast<SwitchInst>(Tramp->getTerminator());
+
+            unsigned SiteID = 0;
+            if (!first) {
+                SiteID = Switch->getNumCases() + 1;
+                Switch->addCase (ConstantInt::get (cast<IntegerType>(Int), SiteID), Succ);
+            }
+            Block->addIncoming (Yield->getArgOperand(0), Pred);
+            Site->addIncoming (ConstantInt::get (Int, SiteID), Pred);
+            Pred->getTerminator()->replaceUsesOfWith (B, Tramp);
+            for (Instruction &I : *Succ) {
+                PHINode *PN = dyn_cast<PHINode>(&I);
+                if (PN == nullptr) break;
+                PN->setIncomingBlock (PN->getBasicBlockIndex (B), Tramp);
+            }
+            B->eraseFromParent ();
+            shared++;
+        }
+        if (Tramps.empty()) continue;
+
+        // repair SSA: definitions that do not dominate their uses anymore
+        DT.recalculate (F);
+        vector<Instruction *> Defs;
+        for (BasicBlock &B : F) {
+            for (Instruction &I : B) {
+                for (Use &U : I.uses()) {
+                    if (!DT.dominates (&I, U)) {
+                        Defs.push_back (&I);
+                        break;
+                    }
+                }
+            }
+        }
+        vector<AllocaInst *> Slots;
+        Instruction *AllocaPoint = F.getEntryBlock().getFirstNonPHI();
+        for (Instruction *I : Defs) {
+            if (PHINode *PN = dyn_cast<PHINode>(I)) {
+                T->Instructions.erase (PN);
+                Slots.push_back (DemotePHIToStack (PN, AllocaPoint));
+            } else {
+                Slots.push_back (DemoteRegToStack (*I, false, AllocaPoint));
+            }
+        }
+        if (!Slots.empty()) {
+            DT.recalculate (F);
+            PromoteMemToReg (Slots, DT);
+        }
+    }
+    errs () << "Shared "<< shared <<" yield sites" << endll;
+}
+
+/**
+ * The callable of a std::thread is its constructor's second argument: either
+ * a function (bound by reference) or a functor / lambda object. The
+ * constructor stores an object in the thread state, whose run method
+ * (reached through the state's vtable) invokes its operator(), which takes
+ * the object pointer as first argument. This follows the library code from
+ * the constructor to that operator(); null unless it is unique.
+ */
+static Function *
+cxxThreadEntry (CallInst *Spawn)
+{
+    Value *Callable = Spawn->getArgOperand(1)->stripPointerCasts();
+    if (Function *F = dyn_cast<Function>(Callable))
+        return F;
+
+    SmallPtrSet<Function *, 2> Entries;
+    SmallPtrSet<Constant *, 32> Seen;
+    vector<Constant *> Work(1, Spawn->getCalledFunction());
+    Seen.insert (Work.back());
+    while (!Work.empty()) {
+        Constant *C = Work.back();
+        Work.pop_back();
+        SmallVector<Value *, 16> Ops;
+        if (Function *F = dyn_cast<Function>(C)) {
+            if (F->isDeclaration()) continue;
+            if (!isStdFunction (F)) { // user code is not part of the thread state
+                if (F->getName().find("clE") != StringRef::npos && !F->arg_empty() &&
+                        F->arg_begin()->getType() == Callable->getType()) {
+                    Entries.insert (F);
+                }
+                continue;
+            }
+            for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+                Ops.append (I->op_begin(), I->op_end());
+        } else if (GlobalVariable *G = dyn_cast<GlobalVariable>(C)) {
+            if (G->hasInitializer()) Ops.push_back (G->getInitializer());
+        } else {
+            Ops.append (C->op_begin(), C->op_end()); // vtables, constant casts
+        }
+        for (Value *Op : Ops) {
+            Constant *D = dyn_cast<Constant>(Op);
+            if (D != nullptr && Seen.insert (D).second) Work.push_back (D);
+        }
+    }
+    return Entries.size() == 1 ? *Entries.begin() : nullptr;
 }
 
 void
@@ -1903,6 +4593,9 @@ LiptonPass::deduceInstances (Module &M)
                 CallInst *Call = dyn_cast_or_null<CallInst>(&I);
                 if (!Call) continue;
                 Function *Callee = Call->getCalledFunction();
+                if (!Callee && isStdFunction (&F)) {
+                    continue; // library wrapper bodies are not walked
+                }
                 if (!Callee) {
                     Type *Type = Call->getCalledValue()->getType();
                     FunctionType *FT = cast<FunctionType>(cast<PointerType>(Type)->getElementType());
@@ -1918,6 +4611,17 @@ LiptonPass::deduceInstances (Module &M)
                         errs () << "ADDED thread: " << F->getName() <<endll;
                     }
                     Threads[F]->Starts.push_back (Call);
+                } else if (cxxPrimitive (Callee) == CxxSpawn && !isStdFunction (&F)) {
+                    Function *F = cxxThreadEntry (Call);
+                    if (F == nullptr) { // its accesses would go unanalyzed
+                        errs () << "ERROR: Unresolved std::thread callable: "<< *Call << endll;
+                        exit (EXIT_FAILURE);
+                    }
+                    if (Threads.find(F) == Threads.end()) {
+                        Threads[F] = new LLVMThread (F, &Threads);
+                        errs () << "ADDED thread: " << F->getName() <<endll;
+                    }
+                    Threads[F]->Starts.push_back (Call);
                 }
             }
         }
@@ -1941,8 +4645,29 @@ LiptonPass::runOnModule (Module &M)
 
     AA = &getAnalysis<AliasAnalysis> ();
 
+    Summaries = new SummaryDB ();
+    if (opts.summaries != nullptr && !Summaries->load (opts.summaries)) {
+        exit (EXIT_FAILURE);
+    }
+    // Summaries reach alias analysis as attributes; a dry run restores them
+    DenseMap<Function *, AttributeSet> Attributes;
+    if (opts.dryRun) {
+        for (Function &F : M) Attributes[&F] = F.getAttributes();
+    }
+    Summaries->annotate (M);
+
     deduceInstances (M);
 
+    // Key plans by the code before Liptonize annotates it
+    string Digest;
+    if (opts.planIn != nullptr || opts.planOut != nullptr || opts.cacheDir != nullptr) {
+        Digest = PlanCache::digest (M, Threads, opts);
+    }
+    PlanCache *Cache = nullptr;
+    if (opts.cacheDir != nullptr && opts.planIn == nullptr) {
+        Cache = new PlanCache (opts.cacheDir, Digest);
+    }
+
     errs () <<" -------------------- "<< "LockSearching" <<" -------------------- "<< endll;
 
     // Statically find instructions for which invariantly a lock is held
@@ -1965,10 +4690,62 @@ LiptonPass::runOnModule (Module &M)
     // Collect movability info
     walkGraph<Collect> (M);
 
+    // Infer the consistently held locks for each alias set
+    inferGuards ();
+
+    // Bound the number of instances of each thread
+    countInstances ();
+
+    // Find symmetric thread instances and their distinct payloads
+    Int64 = Type::getInt64Ty(M.getContext());
+    detectSymmetry (M);
+
+    // Reduce CAS retry loops to a single commit, find bounded loops
+    classifyLoops (M);
+
     errs () <<" -------------------- "<< "Liptonizing" <<" -------------------- "<< endll;
     // Identify and number blocks statically
     // (assuming all dynamic non-movers are static non-movers)
-    walkGraph<Liptonize> (M);
+    YieldPlan Cached;
+    if (opts.planIn != nullptr) {
+        YieldPlan Plan;
+        if (!Plan.read (opts.planIn) || !applyPlan (M, Plan, Digest)) {
+            exit (EXIT_FAILURE);
+        }
+    } else if (Cache != nullptr && Cache->lookup (M, Threads, Cached)) {
+        errs () << "Yield plan cache hit: "<< Cache->key() << endll;
+        applyPlan (M, Cached, Digest);
+    } else {
+        walkGraph<Liptonize> (M);
+
+        // Relocate cycle yields to the cheapest cut points
+        optimizePlacement ();
+
+        if (Cache != nullptr) {
+            errs () << "Yield plan cache miss: "<< Cache->key() << endll;
+            Cached.build (Threads);
+            Cached.Digest = Digest;
+            Cache->store (Cached);
+        }
+    }
+    delete Cache;
+
+    if (opts.planOut != nullptr || opts.dryRun) {
+        YieldPlan Plan;
+        Plan.build (Threads);
+        Plan.Digest = Digest;
+        if (opts.planOut != nullptr && !Plan.write (opts.planOut)) {
+            exit (EXIT_FAILURE);
+        }
+        if (opts.dryRun) {
+            Plan.report (errs());
+            for (pair<Function *, AttributeSet> X : Attributes) X.first->setAttributes (X.second);
+            return false;
+        }
+    }
+
+    // Symmetric threads as module metadata
+    emitSymmetry (M);
 
     errs () <<" -------------------- "<< "Instrumentation" <<" -------------------- "<< endll;
 
@@ -1979,6 +4756,24 @@ LiptonPass::runOnModule (Module &M)
     // Insert dynamic yields
     finalInstrument (M);
 
+    // Remove redundant yields, renumber blocks
+    coalesceYields (M);
+
+    // Exit point __act block sets as masks
+    refineActs (M);
+
+    // Phase variables in SSA form
+    promotePhases ();
+
+    // Clone Top regions into pre and post commit copies
+    specializePhases ();
+
+    // Loop-invariant yield conditions
+    hoistYieldConditions ();
+
+    // Shared yield trampolines
+    shareYields ();
+
     return true; // modified module by inserting yields
 }
 
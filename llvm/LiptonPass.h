@@ -10,16 +10,23 @@
 
 #include <iterator>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include <llvm/Pass.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/Analysis/CallGraph.h>
 #include <llvm/Analysis/AliasAnalysis.h>
 #include <llvm/Analysis/AliasSetTracker.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/SmallVector.h>
 #include <llvm/Support/raw_os_ostream.h>
 
 
@@ -63,16 +70,33 @@ enum pt_e {
 
 static AliasAnalysis                  *AA;
 
+class SummaryDB;
+class YieldPlan;
+
 struct Options {
+    const char *summaries = nullptr; // extra summary file (see Summary.h)
+    const char *planOut = nullptr;   // write the yield plan (see YieldPlan.h)
+    const char *planIn = nullptr;    // apply a yield plan instead of Liptonize
+    bool dryRun = false;             // report the yield plan, leave the code
+    const char *cacheDir = nullptr;  // yield plan cache (see PlanCache.h)
     bool nolock = false;
     bool nodyn = false;
     bool allYield = false;
     bool staticAll = false;
     bool verbose = false;
+    // yield placement weights (see LiptonPass::cutCost)
+    int costYield = 4;      // global yield
+    int costLocal = 2;      // local yield
+    int costPhase = 1;      // phase variable update
+    int costCheck = 2;      // dynamic (phase) check
+    // dynamic yield sites (see LiptonPass::preferStaticYield)
+    int checkSize = 64;     // max. blocks listed by __act plus pointer/lock compares
+    int actPercent = 90;    // min. estimated conflict chance for a static yield
+    int cloneBudget = 256;  // instructions cloned per thread (see specializePhases)
     bool debug = false;
 };
 
-typedef pair<const AliasAnalysis::Location *, CallInst *> PTCallType;
+typedef pair<const AliasAnalysis::Location *, Instruction *> PTCallType;
 
 // Copy-on-write (COW)
 class PThreadType {
@@ -116,14 +140,15 @@ public:
     bool locks  ();
     bool locks1  ();
     PTCallType *get1Lock ();
+    list<PTCallType> &getWriteLocks () { return *WriteLocks; }
 
-    PThreadType *overlap(pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call);
-    PThreadType *add    (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call);
-    PThreadType *missed (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call);
-    PThreadType *eraseAlias     (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call);
+    PThreadType *overlap(pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call);
+    PThreadType *add    (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call);
+    PThreadType *missed (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call);
+    PThreadType *eraseAlias     (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call);
 
     // exception to COW (used to reduce lock set candidates):
-    void eraseNonAlias  (pt_e kind, const AliasAnalysis::Location &Loc, CallInst *Call);
+    void eraseNonAlias  (pt_e kind, const AliasAnalysis::Location &Loc, Instruction *Call);
     void eraseNonAlias (pt_e kind, PThreadType *O);
     PTCallType *merge1 (PThreadType *O);
 
@@ -144,6 +169,20 @@ public:
 struct LLVMThread;
 struct LLVMSCC;
 
+/**
+ * Field-sensitive access path: the base object of a memory access plus the
+ * constant (type, index) steps of the GEPs leading to the accessed field.
+ * A dynamic index truncates the path; only the known prefix is compared,
+ * otherwise the coarse alias sets decide.
+ */
+struct FieldPath {
+    Value                                  *Base = nullptr;
+    SmallVector<pair<Type *, int64_t>, 4>   Path;
+    bool                                    Dynamic = false;
+
+    bool disjoint (FieldPath &O);
+};
+
 struct LLVMInstr {
     area_e          Area    = Unknown;
     mover_e         Mover   = UnknownMover;
@@ -151,8 +190,11 @@ struct LLVMInstr {
     bool            FVS     = false; // member of feedback vertex set?
     PThreadType    *PT      = nullptr;
     bool            isPTCreate= false;
+    bool            isBarrier = false;
     Instruction    *I;
     LLVMSCC        *SCC = nullptr;
+    FieldPath      *Field = nullptr; // set for shared accesses (Collect)
+    uint8_t         Notes = 0;       // Liptonize annotations (see annotate)
 
     bool
     singleThreaded ()
@@ -170,29 +212,52 @@ getFF () {
     return nullptr;
 }
 
+struct LLVMThread;
+
+// Threads in the order of discovery (see deduceInstances), which keeps block
+// ids and output reproducible
+typedef MapVector<Function *, LLVMThread *>     ThreadMap;
+
 struct LLVMThread {
     Function                                   &F;
     vector<CallInst *>                          Starts;
 
     LLVMThread() : F(*getFF()) { assert(false);  }
 
-    LLVMThread(Function *F, DenseMap<Function *, LLVMThread *> *Threads)
+    LLVMThread(Function *F, ThreadMap *Threads)
     :
         F(*F), Threads(Threads)
     {
         Aliases = new AliasSetTracker(*AA);
     }
 
-    int NrRuns ();
+    // Instance count, filled in by LiptonPass::countInstances:
+    int                                         Runs = -2;  // upper bound, -1: unbounded
+    bool                                        RunsExact = false;
+
+    // Symmetry and payloads of the instances (see LiptonPass::detectSymmetry):
+    bool                                        Symmetric = false;
+    Type                                       *SlotType = nullptr; // distinct payload slots
+
+    int NrRuns ();      // exact number of instances, or -1
+    int MaxRuns ();     // upper bound on instances, or -1 (unbounded)
 
     DenseMap<Instruction *, pair<block_e, int>> BlockStarts;
+    DenseMap<Instruction *, SmallVector<BasicBlock *, 2>> Cuts; // cycle cut -> loop headers
     AliasSetTracker                            *Aliases = nullptr;
-    AllocaInst                                 *PhaseVar = nullptr;
+    DenseMap<Function *, AllocaInst *>          Phases; // __phase per instrumented function
+    DenseSet<PHINode *>                         PhasePhis; // see promotePhases
     DenseMap<Instruction *, LLVMInstr *>          Instructions;
-    DenseMap<Function *, LLVMThread *>          *Threads; // pointr to the map in LiptonPass
+    ThreadMap                                  *Threads; // pointr to the map in LiptonPass
 
     bool isSingleton ();
 
+    // BlockStarts ordered by block id
+    vector<pair<Instruction *, pair<block_e, int>>> orderedStarts ();
+
+    // F and the callees walked with it (see walkGraph), in discovery order
+    vector<Function *> functions ();
+
     LLVMInstr   &getInstruction (Instruction* I);
 };
 
@@ -204,6 +269,7 @@ struct LLVMSCC {
     bool                Loops = false;
 
     bool                hasLeftMovers();
+    void                setLeftMovers (bool left) { hasLeft = left; }
 
     void
     add (Instruction *I)
@@ -232,7 +298,16 @@ public:
     LiptonPass(string name, Options &opts);
 
     DenseMap<AliasSet *, list<LLVMInstr *>>         AS2I;
-    DenseMap<Function *, LLVMThread *>              Threads;
+    ThreadMap                                       Threads;
+    DenseMap<AliasSet *, PThreadType *>             Guards; // see inferGuards
+    SummaryDB                                      *Summaries = nullptr;
+    DenseMap<BasicBlock *, Instruction *>           RetryLoops; // header -> CAS
+    DenseSet<Instruction *>                         RetryReads; // see classifyLoops
+    DenseMap<BasicBlock *, vector<BasicBlock *>>    BoundedLoops; // header -> blocks
+    DenseMap<BasicBlock *, vector<BasicBlock *>>    LoopCuts; // header -> cut blocks
+    MapVector<Instruction *, SmallVector<LLVMInstr *, 8>> ActConflicts; // __act -> J
+    DenseMap<Instruction *, SmallVector<Value *, 2>> ActChecks; // __act -> pointer/lock checks
+    std::map<vector<uint64_t>, GlobalVariable *>    Masks; // see blockMask
 
     struct Processor {
         LiptonPass                 *Pass;
@@ -247,6 +322,7 @@ public:
         virtual void thread (Function *F) {}
         virtual bool block (BasicBlock &B) { return false; }
         virtual void deblock (BasicBlock &B) {  }
+        virtual void edge (TerminatorInst *T, int i, bool enter) {  }
         block_e isBlockStart (Instruction *I);
     };
 
@@ -254,6 +330,13 @@ private:
     Processor                      *handle = nullptr;
 
     void dynamicYield (LLVMThread *T, Instruction *I, block_e type, int b);
+    AllocaInst *phaseVar (LLVMThread *T, Function *G);
+    vector<pair<LLVMThread *, Function *>> threadFunctions ();
+    bool applyPlan (Module &M, YieldPlan &Plan, const string &Digest);
+    bool preferStaticYield (SmallVectorImpl<pair<unsigned, unsigned>> &Listed,
+                            unsigned compares, Instruction *I);
+    int  staticSites = 0;
+    int  dynamicSites = 0;
     void staticYield (LLVMThread *T, Instruction *I, block_e type, int b);
     // getAnalysisUsage - This pass requires the CallGraph.
     virtual void getAnalysisUsage(AnalysisUsage &AU) const;
@@ -265,26 +348,48 @@ private:
     template <typename ProcessorT>
     void walkGraph (Module &M);
 
+    bool summaryPointers (Instruction *I, SmallVectorImpl<Value *> &Ptrs);
+    void aliasSets (AliasSetTracker *AST, Instruction *I, SmallVectorImpl<AliasSet *> &Sets);
+    vector<LLVMInstr *> aliasing (LLVMThread *T2, Instruction *I);
     bool conflictingNonMovers (SmallVector<Value*, 8> &sv,
                                SmallVector<LLVMInstr *, 8> *Is,
                                Instruction *I, LLVMThread *T);
     void initialInstrument (Module &M);
     void finalInstrument (Module &M);
+    void coalesceYields (Module &M);
+    void refineActs (Module &M);
+    Constant *blockMask (Module &M, const std::set<int> &Blocks);
+    void promotePhases ();
+    void specializePhases ();
+    void hoistYieldConditions ();
+    void shareYields ();
     void deduceInstances (Module &M);
     void refineAliasSets();
+    void inferGuards ();
+    void countInstances ();
+    int  countInstances (LLVMThread *T);
+    int  spawnTrips (CallInst *Spawn, bool &Exact);
+    void detectSymmetry (Module &M);
+    void emitSymmetry (Module &M);
+    Type *payloadSlots (LLVMThread *T);
+    int  cutCost (LLVMThread *T, Instruction *I);
+    void optimizePlacement ();
+    void classifyLoops (Module &M);
+    bool retryLoop (Loop *L, DominatorTree &DT);
     Instruction *addFixedCAS (LLVMInstr& LI, block_e type, int block,
                               Instruction* NextTerm, SmallVector<LLVMInstr*, 8> &Is,
-                              AllocaInst* Phase);
+                              AllocaInst* Phase, SmallVectorImpl<Value *> &Checks);
     Instruction *addStaticPtr (LLVMInstr& LI, block_e type, int block,
                               Instruction* NextTerm, SmallVector<LLVMInstr*, 8> &Is,
-                              AllocaInst* Phase);
+                              AllocaInst* Phase, SmallVectorImpl<Value *> &Checks);
     bool obtainFixedPtrValue (SmallVector<Value *, 8> &cs,
                               SmallVector<LLVMInstr *, 8> &Is,
                               LLVMInstr &LI, bool verbose);
     Value *obtainFixedPtr (LLVMInstr &LI);
 
-    LLVMInstr *lockPointers (SmallVector<Value *, 8> &pts,
-                             SmallVector<LLVMInstr *, 8> &Is, LLVMInstr &LI);
+    bool lockPointers (SmallVector<Value *, 4> &Mine,
+                       vector<SmallVector<Value *, 4>> &Others,
+                       SmallVector<LLVMInstr *, 8> &Is, LLVMInstr &LI);
 };
 
 }
@@ -0,0 +1,167 @@
+#include "llvm/PlanCache.h"
+#include "llvm/Util.h"
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Attributes.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace VVT {
+
+/**
+ * Prints the attributes of F, which Summaries->annotate may change (and which
+ * F->print only refers to by attribute group).
+ */
+static void
+printAttributes (Function *F, raw_ostream &OS)
+{
+    AttributeSet AS = F->getAttributes();
+    OS << "attributes "<< F->getName();
+    for (unsigned i = 0; i < AS.getNumSlots(); i++) {
+        unsigned Index = AS.getSlotIndex(i);
+        OS << " "<< Index <<":"<< AS.getAsString (Index);
+    }
+    OS << "\n";
+}
+
+/**
+ * Prints the functions and globals in Work and what they reach (calls,
+ * function pointers, global initializers, e.g. vtables) in discovery order:
+ * the code of defined functions, and the attributes of all functions.
+ */
+static void
+printReachable (vector<Constant *> Work, raw_ostream &OS)
+{
+    SmallPtrSet<Constant *, 64> Seen;
+    for (Constant *C : Work) Seen.insert (C);
+    while (!Work.empty()) {
+        Constant *C = Work.back();
+        Work.pop_back();
+        SmallVector<Value *, 16> Ops;
+        if (Function *G = dyn_cast<Function>(C)) {
+            printAttributes (G, OS);
+            if (G->isDeclaration()) continue;
+            G->print (OS);
+            for (inst_iterator I = inst_begin(G), E = inst_end(G); I != E; ++I)
+                Ops.append (I->op_begin(), I->op_end());
+        } else if (GlobalVariable *G = dyn_cast<GlobalVariable>(C)) {
+            if (G->hasInitializer()) Ops.push_back (G->getInitializer());
+        } else {
+            Ops.append (C->op_begin(), C->op_end()); // aggregates, constant expressions
+        }
+        for (Value *Op : Ops) {
+            Constant *D = dyn_cast<Constant>(Op);
+            if (D != nullptr && Seen.insert (D).second) Work.push_back (D);
+        }
+    }
+}
+
+/**
+ * The key, also recorded in plan files (see YieldPlan.h).
+ */
+string
+PlanCache::digest (Module &M, ThreadMap &Threads, Options &opts)
+{
+    MD5 Hash;
+    string Text;
+    raw_string_ostream OS(Text);
+
+    OS.write (PLAN_MAGIC, sizeof (PLAN_MAGIC));
+    OS << " "<< ANALYSIS_VERSION <<" "<< LLVM_VERSION_MAJOR <<"."<< LLVM_VERSION_MINOR;
+    OS << " "<< opts.nolock <<" "<< opts.nodyn <<" "<< opts.staticAll <<" "
+       << opts.allYield <<" "<< opts.debug <<" "<< opts.costYield <<","
+       << opts.costLocal <<","<< opts.costPhase <<","<< opts.costCheck << "\n";
+    vector<Constant *> Globals;
+    for (GlobalVariable &G : M.globals()) {
+        OS << G << "\n";
+        Globals.push_back (&G);
+    }
+    printReachable (Globals, OS); // functions referenced from initializers
+    if (opts.summaries != nullptr) {
+        ErrorOr<unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile (opts.summaries);
+        if (Buf) OS << (*Buf)->getBuffer();
+    }
+    Hash.update (OS.str());
+
+    for (pair<Function *, LLVMThread *> &X : Threads) {
+        Text.clear ();
+        OS << "thread "<< X.first->getName() << "\n";
+        printReachable (vector<Constant *>(1, X.first), OS);
+        Hash.update (OS.str());
+    }
+
+    MD5::MD5Result Result;
+    Hash.final (Result);
+    SmallString<32> Digest;
+    MD5::stringifyResult (Result, Digest);
+    return Digest.str();
+}
+
+string
+PlanCache::path ()
+{
+    return Dir + "/" + Key + ".plan";
+}
+
+/**
+ * Reads the entry for the key, if any, and checks that it covers exactly
+ * the threads of M, so that applying it cannot fail halfway.
+ */
+bool
+PlanCache::lookup (Module &M, ThreadMap &Threads, YieldPlan &Plan)
+{
+    string File = path ();
+    if (!sys::fs::exists (File)) return false;
+    if (!Plan.read (File.c_str())) return false;
+
+    if (Plan.Digest != Key || Plan.Threads.size() != Threads.size()) {
+        errs () << "WARNING: Stale yield plan in cache: "<< File << endll;
+        return false;
+    }
+    for (ThreadPlan &P : Plan.Threads) {
+        Function *F = M.getFunction (P.Function);
+        if (F == nullptr || Threads.count (F) == 0 ||
+                YieldPlan::instructions (Threads[F]).size() != P.Size) {
+            errs () << "WARNING: Stale yield plan in cache: "<< File << endll;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes the entry under a temporary name first, so that concurrent runs
+ * never read a partial plan.
+ */
+void
+PlanCache::store (YieldPlan &Plan)
+{
+    std::error_code EC = sys::fs::create_directories (Dir);
+    int FD;
+    SmallString<128> Tmp;
+    if (!EC) EC = sys::fs::createUniqueFile (Dir + "/%%%%%%%%.tmp", FD, Tmp);
+    if (EC) {
+        errs () << "WARNING: Cannot write yield plan cache "<< Dir <<": "<< EC.message() << endll;
+        return;
+    }
+    {
+        raw_fd_ostream OS(FD, true);
+        Plan.write (OS);
+    }
+    EC = sys::fs::rename (Tmp.str(), path ());
+    if (EC) {
+        errs () << "WARNING: Cannot write yield plan cache "<< path () <<": "<< EC.message() << endll;
+        sys::fs::remove (Tmp.str());
+    }
+}
+
+}
@@ -0,0 +1,58 @@
+/*
+ * PlanCache.h
+ *
+ *  Content-addressed on-disk cache of yield plans (see YieldPlan.h), so that
+ *  re-running the pass on unchanged code skips the mover analysis.
+ */
+
+#ifndef LIPTONBIN_LLVM_PLANCACHE_H_
+#define LIPTONBIN_LLVM_PLANCACHE_H_
+
+#include "llvm/LiptonPass.h"
+#include "llvm/YieldPlan.h"
+
+#include <string>
+
+#include <llvm/IR/Module.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace VVT {
+
+/**
+ * Salts the key; bump it whenever the analysis may produce different plans
+ * for the same code.
+ */
+static const int ANALYSIS_VERSION = 1;
+
+/**
+ * The key is an MD5 digest over the code of every thread function and the
+ * functions it reaches, the module globals and the functions they refer to,
+ * the attributes of all these functions, the summary file, the analysis and
+ * LLVM versions and the options that influence the analysis. Since the
+ * movers of one thread depend on the accesses of all others, a plan is only
+ * reused for the complete set of threads. Entries are plan files named
+ * <dir>/<key>.plan.
+ */
+class PlanCache {
+public:
+    PlanCache (const char *dir, const string &key) : Dir(dir), Key(key) {}
+
+    static string digest (Module &M, ThreadMap &Threads, Options &opts);
+
+    bool        lookup (Module &M, ThreadMap &Threads, YieldPlan &Plan);
+    void        store (YieldPlan &Plan);
+
+    const string &key () { return Key; }
+
+private:
+    string      Dir;
+    string      Key;
+
+    string      path ();
+};
+
+}
+
+#endif /* LIPTONBIN_LLVM_PLANCACHE_H_ */
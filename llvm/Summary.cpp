@@ -0,0 +1,171 @@
+#include "llvm/Summary.h"
+#include "llvm/Util.h"
+
+#include <stdlib.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Attributes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace VVT {
+
+static const char *DEFAULT_SUMMARIES =
+    "# allocation: both movers on fresh memory\n"
+    "malloc         both    alloc\n"
+    "calloc         both    alloc\n"
+    "realloc        auto    alloc write:0\n"
+    "free           auto    write:0\n"
+    "# memory and strings\n"
+    "memcpy         auto    write:0 read:1\n"
+    "memmove        auto    write:0 read:1\n"
+    "memset         auto    write:0\n"
+    "memcmp         auto    read:0 read:1\n"
+    "strlen         auto    read:0\n"
+    "strcmp         auto    read:0 read:1\n"
+    "strncmp        auto    read:0 read:1\n"
+    "strcpy         auto    write:0 read:1\n"
+    "strncpy        auto    write:0 read:1\n"
+    "strcat         auto    write:0 read:0 read:1\n"
+    "qsort          auto    write:0\n"
+    "# I/O: internally locked streams\n"
+    "printf         both    safe\n"
+    "fprintf        both    safe\n"
+    "puts           both    safe\n"
+    "putchar        both    safe\n"
+    "perror         both    safe\n"
+    "sprintf        auto    write:0\n"
+    "snprintf       auto    write:0\n"
+    "# global state\n"
+    "rand           auto    global\n"
+    "srand          auto    global\n"
+    "# pthread and verifier helpers without shared effects\n"
+    "pthread_self               both    safe\n"
+    "pthread_exit               both    safe\n"
+    "pthread_mutex_destroy      both    safe\n"
+    "pthread_attr_init          both    write:0\n"
+    "pthread_attr_destroy       both    write:0\n"
+    "sched_yield                both    safe\n"
+    "usleep                     both    safe\n"
+    "sleep                      both    safe\n"
+    "__nondet_int               both    safe\n"
+    "__nondet_uint              both    safe\n"
+    "__nondet_size              both    safe\n"
+    "__nondet_bool              both    safe\n"
+    "assume                     both    safe\n";
+
+SummaryDB::SummaryDB ()
+{
+    bool ok = parse (DEFAULT_SUMMARIES, "<default>");
+    assert (ok);
+    (void) ok;
+}
+
+static bool
+parseIndex (StringRef Token, StringRef Prefix, uint64_t &Mask)
+{
+    unsigned Index;
+    if (Token.substr(Prefix.size()).getAsInteger(10, Index) || Index >= 64)
+        return false;
+    Mask |= 1ULL << Index;
+    return true;
+}
+
+bool
+SummaryDB::parse (StringRef text, StringRef origin)
+{
+    SmallVector<StringRef, 64> Lines;
+    text.split (Lines, "\n");
+    for (unsigned l = 0; l < Lines.size(); l++) {
+        StringRef Line = Lines[l].split('#').first.trim();
+        if (Line.empty()) continue;
+
+        SmallVector<StringRef, 8> Fields;
+        SplitString (Line, Fields);
+        if (Fields.size() < 2) {
+            errs () << origin << ":" << l + 1 << ": missing mover: " << Line << endll;
+            return false;
+        }
+
+        Summary S;
+        if (Fields[1] == "right") {
+            S.Mover = RightMover;
+        } else if (Fields[1] == "left") {
+            S.Mover = LeftMover;
+        } else if (Fields[1] == "both") {
+            S.Mover = BothMover;
+        } else if (Fields[1] != "auto") {
+            errs () << origin << ":" << l + 1 << ": unknown mover: " << Fields[1] << endll;
+            return false;
+        }
+        for (unsigned i = 2; i < Fields.size(); i++) {
+            StringRef F = Fields[i];
+            bool ok = true;
+            if (F.startswith("read:")) {
+                ok = parseIndex (F, "read:", S.Reads);
+            } else if (F.startswith("write:")) {
+                ok = parseIndex (F, "write:", S.Writes);
+            } else if (F == "alloc") {
+                S.Alloc = true;
+            } else if (F == "safe") {
+                S.Safe = true;
+            } else if (F == "global") {
+                S.Global = true;
+            } else {
+                ok = false;
+            }
+            if (!ok) {
+                errs () << origin << ":" << l + 1 << ": unknown effect: " << F << endll;
+                return false;
+            }
+        }
+        Map[Fields[0]] = S;
+    }
+    return true;
+}
+
+bool
+SummaryDB::load (const char *file)
+{
+    ErrorOr<unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile (file);
+    if (!Buf) {
+        errs () << "Failed reading summaries " << file << ": "
+                << Buf.getError().message() << endll;
+        return false;
+    }
+    return parse ((*Buf)->getBuffer(), file);
+}
+
+Summary *
+SummaryDB::lookup (Function *F)
+{
+    if (F == nullptr || !F->isDeclaration()) return nullptr;
+    StringMap<Summary>::iterator It = Map.find (F->getName());
+    return It == Map.end() ? nullptr : &It->second;
+}
+
+/**
+ * Passes the summarized facts to alias analysis through function attributes.
+ */
+void
+SummaryDB::annotate (Module &M)
+{
+    for (Function &F : M) {
+        Summary *S = lookup (&F);
+        if (S == nullptr) continue;
+        if (S->Alloc) {
+            F.setDoesNotAlias (0); // return value
+        }
+        if (S->Reads && !S->Writes && !S->Alloc && !S->Global) {
+            F.setOnlyReadsMemory ();
+        }
+    }
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+ * Summary.h
+ *
+ *  Mover summaries for external (library) functions, whose bodies are not
+ *  available to the analysis.
+ */
+
+#ifndef LIPTONBIN_LLVM_SUMMARY_H_
+#define LIPTONBIN_LLVM_SUMMARY_H_
+
+#include "llvm/LiptonPass.h"
+
+#include <stdint.h>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Module.h>
+
+using namespace llvm;
+
+namespace VVT {
+
+/**
+ * Memory effects and mover class of an external function.
+ * Reads and Writes are bit masks over the (pointer) argument indices.
+ */
+struct Summary {
+    mover_e         Mover   = UnknownMover; // Unknown: derived from conflicts
+    uint64_t        Reads   = 0;
+    uint64_t        Writes  = 0;
+    bool            Alloc   = false;        // returns fresh memory
+    bool            Safe    = false;        // internally synchronized
+    bool            Global  = false;        // touches hidden global state
+
+    bool
+    shared ()
+    {
+        // a fresh result (Alloc) does not make the argument effects local
+        return !Safe && (Reads || Writes || Global);
+    }
+};
+
+/**
+ * Summary file format, one function per line ('#' starts a comment):
+ *
+ *   <name> <right|left|both|auto> [read:<i>] [write:<i>] [alloc] [safe] [global]
+ *
+ * 'auto' derives the mover from the conflicts of the function's effects.
+ * Later definitions override earlier ones.
+ */
+class SummaryDB {
+    StringMap<Summary>      Map;
+
+public:
+    SummaryDB ();           // loads the default libc / pthread summaries
+
+    bool        load (const char *file);
+    bool        parse (StringRef text, StringRef origin);
+    Summary    *lookup (Function *F);
+    void        annotate (Module &M);
+};
+
+}
+
+#endif /* LIPTONBIN_LLVM_SUMMARY_H_ */
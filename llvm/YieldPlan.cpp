@@ -0,0 +1,204 @@
+#include "llvm/YieldPlan.h"
+#include "llvm/Util.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <llvm/IR/InstIterator.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace VVT {
+
+vector<Instruction *>
+YieldPlan::instructions (LLVMThread *T)
+{
+    vector<Instruction *> Is;
+    for (Function *F : T->functions()) {
+        for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+            Is.push_back (&*I);
+        }
+    }
+    return Is;
+}
+
+void
+YieldPlan::build (ThreadMap &Ts)
+{
+    Threads.clear ();
+    for (pair<Function *, LLVMThread *> X : Ts) {
+        LLVMThread *T = X.second;
+        vector<Instruction *> Is = instructions (T);
+        DenseMap<Instruction *, uint32_t> Ordinal;
+        for (uint32_t i = 0; i < Is.size(); i++) Ordinal[Is[i]] = i;
+
+        ThreadPlan P;
+        P.Function = T->F.getName();
+        P.Size = Is.size();
+        for (Instruction *I : Is) {
+            LLVMInstr *LI = T->Instructions.lookup (I);
+            InstrMark K = { Unknown, UnknownMover, 0, 0 };
+            if (LI != nullptr) {
+                K.Area = LI->Area;
+                K.Mover = LI->Mover;
+                K.Notes = LI->Notes;
+            }
+            P.Marks.push_back (K);
+        }
+        for (pair<Instruction *, pair<block_e, int>> Y : T->BlockStarts) {
+            LLASSERT (Ordinal.count (Y.first), "Block start outside the thread functions: "<< *Y.first);
+            LLVMInstr &LI = T->getInstruction(Y.first);
+            YieldSite S;
+            S.Instr = Ordinal.lookup (Y.first);
+            S.Block = Y.second.second;
+            S.Type = Y.second.first;
+            S.Mover = LI.Mover;
+            S.Area = LI.Area;
+            S.Flags = (LI.Atomic ? SITE_ATOMIC : 0) |
+                      (LI.SCC != nullptr && LI.SCC->hasLeftMovers() ? SITE_LEFT_SCC : 0);
+            P.Sites.push_back (S);
+        }
+        sort (P.Sites.begin(), P.Sites.end(),
+              [] (const YieldSite &A, const YieldSite &B) { return A.Instr < B.Instr; });
+        Threads.push_back (P);
+    }
+    sort (Threads.begin(), Threads.end(),
+          [] (const ThreadPlan &A, const ThreadPlan &B) { return A.Function < B.Function; });
+}
+
+static void
+put32 (raw_ostream &OS, uint32_t V)
+{
+    OS.write ((const char *) &V, sizeof (V));
+}
+
+static bool
+get32 (const char *data, size_t size, size_t &Off, uint32_t &V)
+{
+    if (Off + sizeof (V) > size) return false;
+    memcpy (&V, data + Off, sizeof (V));
+    Off += sizeof (V);
+    return true;
+}
+
+bool
+YieldPlan::write (const char *file)
+{
+    std::error_code EC;
+    raw_fd_ostream OS(file, EC, sys::fs::F_None);
+    if (EC) {
+        errs () << "ERROR: Cannot write yield plan "<< file <<": "<< EC.message() << endll;
+        return false;
+    }
+    write (OS);
+    return true;
+}
+
+void
+YieldPlan::write (raw_ostream &OS)
+{
+    OS.write (PLAN_MAGIC, sizeof (PLAN_MAGIC));
+    LLASSERT (Digest.size() == PLAN_DIGEST, "Yield plan without digest");
+    OS << Digest;
+    put32 (OS, Threads.size());
+    for (ThreadPlan &P : Threads) {
+        put32 (OS, P.Function.size());
+        OS << P.Function;
+        for (size_t i = P.Function.size(); i % 4 != 0; i++) OS << '\0';
+        put32 (OS, P.Size);
+        put32 (OS, P.Sites.size());
+        OS.write ((const char *) P.Sites.data(), P.Sites.size() * sizeof (YieldSite));
+        OS.write ((const char *) P.Marks.data(), P.Marks.size() * sizeof (InstrMark));
+    }
+}
+
+bool
+YieldPlan::read (const char *file)
+{
+    // mapped where possible, the sites are copied out
+    ErrorOr<unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile (file, -1, false);
+    if (!Buf) {
+        errs () << "ERROR: Cannot read yield plan "<< file <<": "<< Buf.getError().message() << endll;
+        return false;
+    }
+    return parse ((*Buf)->getBufferStart(), (*Buf)->getBufferSize(), file);
+}
+
+bool
+YieldPlan::parse (const char *data, size_t size, const char *origin)
+{
+    size_t Off = sizeof (PLAN_MAGIC) + PLAN_DIGEST;
+    uint32_t Nr;
+    if (size < Off || memcmp (data, PLAN_MAGIC, sizeof (PLAN_MAGIC)) != 0 ||
+            !get32 (data, size, Off, Nr)) {
+        errs () << "ERROR: Not a yield plan: "<< origin << endll;
+        return false;
+    }
+    Digest.assign (data + sizeof (PLAN_MAGIC), PLAN_DIGEST);
+    Threads.clear ();
+    for (uint32_t t = 0; t < Nr; t++) {
+        ThreadPlan P;
+        uint32_t Length, Sites;
+        if (!get32 (data, size, Off, Length) || Off + Length > size) break;
+        P.Function.assign (data + Off, Length);
+        Off += (Length + 3) & ~3u;
+        if (!get32 (data, size, Off, P.Size) || !get32 (data, size, Off, Sites) ||
+                Off + Sites * sizeof (YieldSite) > size) {
+            break;
+        }
+        P.Sites.resize (Sites);
+        memcpy (P.Sites.data(), data + Off, Sites * sizeof (YieldSite));
+        Off += Sites * sizeof (YieldSite);
+        if (Off + P.Size * sizeof (InstrMark) > size) break;
+        P.Marks.resize (P.Size);
+        memcpy (P.Marks.data(), data + Off, P.Size * sizeof (InstrMark));
+        Off += P.Size * sizeof (InstrMark);
+        Threads.push_back (P);
+    }
+    if (Threads.size() != Nr) {
+        errs () << "ERROR: Truncated yield plan: "<< origin << endll;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Yields that staticYield would insert for the site (an estimate for the
+ * dynamic instrumentation, whose checks may skip them).
+ */
+static int
+staticYields (YieldSite &S)
+{
+    if (S.Type == StartBlock) return 0;
+    if (S.Type == LoopBlock) return 1;
+    if (S.Flags & SITE_ATOMIC) return S.Type & LoopBlock ? 1 : 0;
+    if ((S.Mover == RightMover || S.Mover == NoneMover) && (S.Area & Post)) return 1;
+    return S.Type & LoopBlock ? 1 : 0;
+}
+
+void
+YieldPlan::report (raw_ostream &OS)
+{
+    int total = 0;
+    for (ThreadPlan &P : Threads) {
+        int yields = 0, cycles = 0, coinciding = 0, estimate = 0;
+        for (YieldSite &S : P.Sites) {
+            yields += S.Type == YieldBlock;
+            cycles += S.Type == LoopBlock;
+            coinciding += S.Type == CoincidingBlock;
+            estimate += staticYields (S);
+        }
+        OS << "Yield plan "<< P.Function <<": "<< P.Sites.size() <<" blocks ("<< yields
+           <<" yield, "<< cycles <<" cycle, "<< coinciding <<" coinciding), "<< estimate
+           <<" static yields" << endll;
+        total += estimate;
+    }
+    OS << "Yield plan total: "<< total <<" static yields" << endll;
+}
+
+}
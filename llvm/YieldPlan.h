@@ -0,0 +1,92 @@
+/*
+ * YieldPlan.h
+ *
+ *  The outcome of the Lipton analysis: the block starts of each thread and
+ *  how they are instrumented, independent of the IR mutation (see
+ *  LiptonPass::applyPlan).
+ */
+
+#ifndef LIPTONBIN_LLVM_YIELDPLAN_H_
+#define LIPTONBIN_LLVM_YIELDPLAN_H_
+
+#include "llvm/LiptonPass.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Function.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace VVT {
+
+/**
+ * A block start. Fixed size and layout, so that plan files can be mapped.
+ */
+struct YieldSite {
+    uint32_t        Instr;      // ordinal of the instruction in its thread
+    int32_t         Block;      // block id
+    int8_t          Type;       // block_e
+    int8_t          Mover;      // mover_e
+    int8_t          Area;       // area_e
+    uint8_t         Flags;      // see SITE_*
+};
+
+/**
+ * The Liptonize outcome for any instruction, also fixed size.
+ */
+struct InstrMark {
+    int8_t          Area;       // area_e
+    int8_t          Mover;      // mover_e
+    uint8_t         Notes;      // annotations (see LLVMInstr::Notes)
+    uint8_t         Pad;
+};
+
+static const char PLAN_MAGIC[4] = { 'L', 'Y', 'P', '4' };
+static const size_t PLAN_DIGEST = 32;    // hex MD5, see PlanCache::digest
+
+static const uint8_t SITE_ATOMIC    = 1 << 0;
+static const uint8_t SITE_LEFT_SCC  = 1 << 1; // left movers in its SCC
+
+struct ThreadPlan {
+    string                  Function;
+    uint32_t                Size = 0;   // instructions in the thread functions
+    vector<YieldSite>       Sites;      // ordered by Instr
+    vector<InstrMark>       Marks;      // one per instruction
+};
+
+/**
+ * Binary format (native byte order, all fields 4-byte aligned):
+ *
+ *   "LYP4" <digest> <u32 threads> { <u32 name length> <name, zero padded to 4>
+ *                          <u32 size> <u32 sites> <YieldSite x sites>
+ *                          <InstrMark x size> }*
+ *
+ * Threads are ordered by function name, which makes the file (and the block
+ * numbering) reproducible. Instructions are numbered over the thread function
+ * and the callees it reaches (LLVMThread::functions), in that order, since
+ * block starts may lie in callees. The digest identifies the code the plan
+ * stems from (the PlanCache key), so that it is not applied to other code.
+ */
+class YieldPlan {
+public:
+    string                  Digest;
+    vector<ThreadPlan>      Threads;
+
+    static vector<Instruction *> instructions (LLVMThread *T);
+
+    void        build (ThreadMap &Threads);
+    bool        write (const char *file);
+    void        write (raw_ostream &OS);
+    bool        read (const char *file);
+    bool        parse (const char *data, size_t size, const char *origin);
+    void        report (raw_ostream &OS);
+};
+
+}
+
+#endif /* LIPTONBIN_LLVM_YIELDPLAN_H_ */